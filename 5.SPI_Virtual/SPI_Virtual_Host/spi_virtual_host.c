@@ -1,89 +1,760 @@
 /* Beaglebone Black has 2 SPI Controllers namely spi0 and spi1 */
 /* We have created a virtual controller attached to the spi interface
    called spi2 */
-/* This low level driver hooks to the platform_core at the lower level 
+/* This low level driver hooks to the platform_core at the lower level
    and spi_core at the higher level */
-/* The Corresponding Functions are called when a client accesses this 
-   host controller and this is indicated using print statements */
-/* In real spi low level driver these functions will directly access 
+/* In real spi low level driver these functions will directly access
    the hardware registers for a specific task. */
+/* Here a chip select with a flash device on it instead has a RAM backed
+   model of an Atmel AT45DB161D/321D DataFlash behind it, which decodes
+   the command set in spi_flash.h including the busy times of the 
+   internal operations. The spi_flash driver then runs and can be 
+   benchmarked on any Linux box with no hardware attached. Other clients,
+   like spi_virtual_client, see the plain controller. */
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/spi/spi.h>
+#include <linux/property.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/of.h>
+#include <linux/ioctl.h>
+#include "../../6.SPI_Flash/spi_flash.h"
 
-/* Setup mode and clock, etc (spi driver may call many times) */
-static int spi_vhost_setup(struct spi_device *spi)
+/* Chip selects of the controller, each one may have a flash model */
+#define VHOST_NUM_CS        2
+#define VHOST_MAX_SPEED_HZ  66000000
+
+/* spi_flash.c only has a device tree match table, without one the SPI
+   core falls back to comparing the modalias with the driver name */
+#define VHOST_FLASH_MODALIAS "SPI_Flash_Driver"
+
+/* DataFlash pages are 528 bytes, binary page mode hides the last 16 */
+#define VFLASH_PAGE_RAW     528
+#define VFLASH_PAGE_POW2    512
+#define VFLASH_BLOCK_PAGES  8
+/* Longest command header, opcode + 3 address bytes + 4 dummy bytes */
+#define VFLASH_HDR_MAX      8
+
+static char *model = "at45db161d";
+module_param(model, charp, 0444);
+MODULE_PARM_DESC(model, "Emulated part, at45db161d or at45db321d");
+
+static unsigned int chips = 1;
+module_param(chips, uint, 0444);
+MODULE_PARM_DESC(chips, "Flash devices added when there is no device tree");
+
+static bool pow2;
+module_param(pow2, bool, 0444);
+MODULE_PARM_DESC(pow2, "Start in binary (512 byte) page mode, parts ship in 528 byte mode");
+
+static bool emulate_clock;
+module_param(emulate_clock, bool, 0644);
+MODULE_PARM_DESC(emulate_clock, "Take as long as the transfer would at the SPI clock rate");
+
+/* Busy times of the internal operations, typical values of the datasheet */
+static unsigned int xfer_us = 200;
+module_param(xfer_us, uint, 0644);
+MODULE_PARM_DESC(xfer_us, "Page to buffer transfer and compare time (tXFR)");
+
+static unsigned int erase_program_us = 14000;
+module_param(erase_program_us, uint, 0644);
+MODULE_PARM_DESC(erase_program_us, "Page erase and program time (tEP)");
+
+static unsigned int program_us = 2000;
+module_param(program_us, uint, 0644);
+MODULE_PARM_DESC(program_us, "Page program without erase time (tP)");
+
+static unsigned int page_erase_us = 13000;
+module_param(page_erase_us, uint, 0644);
+MODULE_PARM_DESC(page_erase_us, "Page erase time (tPE)");
+
+static unsigned int block_erase_us = 30000;
+module_param(block_erase_us, uint, 0644);
+MODULE_PARM_DESC(block_erase_us, "Block erase time (tBE)");
+
+static unsigned int sector_erase_us = 700000;
+module_param(sector_erase_us, uint, 0644);
+MODULE_PARM_DESC(sector_erase_us, "Sector erase time (tSE)");
+
+static unsigned int chip_erase_us = 12000000;
+module_param(chip_erase_us, uint, 0644);
+MODULE_PARM_DESC(chip_erase_us, "Chip erase time (tCE)");
+
+static unsigned int resume_us = 35;
+module_param(resume_us, uint, 0644);
+MODULE_PARM_DESC(resume_us, "Deep power-down resume time (tRDPD)");
+
+struct vflash_model
 {
-  pr_info("spi_virtual_host.c   : %s\r\n",__func__);
-  return 0;
+  const char  *name;
+  uint8_t      id[5];
+  unsigned int pages;
+  unsigned int sector_pages;
+  uint8_t      density;     /* Status register bits 5 - 2 */
+};
+
+static const struct vflash_model vflash_models[] = {
+  {"at45db161d", {0x1F, 0x26, 0x00, 0x01, 0x00}, 4096, 256, 0x2C},
+  {"at45db321d", {0x1F, 0x27, 0x01, 0x01, 0x00}, 8192, 128, 0x34},
+};
+
+enum vflash_kind
+{
+  VF_NONE,
+  VF_ARRAY_READ,
+  VF_PAGE_READ,
+  VF_BUF_READ,
+  VF_BUF_WRITE,
+  VF_PROGRAM,           /* Buffer to main memory with built-in erase */
+  VF_PROGRAM_NOERASE,
+  VF_PROGRAM_THROUGH,   /* Buffer write followed by VF_PROGRAM */
+  VF_TRANSFER,
+  VF_COMPARE,
+  VF_REWRITE,
+  VF_PAGE_ERASE,
+  VF_BLOCK_ERASE,
+  VF_SECTOR_ERASE,
+  VF_CHIP_ERASE,
+  VF_CONFIG,            /* 0x3D 0x2A ... four byte commands */
+  VF_STATUS,
+  VF_ID,
+  VF_POWER_DOWN,
+  VF_RESUME,
+};
+
+/* Opcode, what it does, bytes before the data phase and its buffer */
+struct vflash_op
+{
+  uint8_t opcode;
+  uint8_t kind;
+  uint8_t hdr_len;
+  uint8_t bufno;
+};
+
+static const struct vflash_op vflash_ops[] = {
+  {FLASH_CONTINUOUS_ARRAY_READ_LEGACY,               VF_ARRAY_READ,      8, 0},
+  {FLASH_CONTINUOUS_ARRAY_READ_HF,                   VF_ARRAY_READ,      5, 0},
+  {FLASH_CONTINUOUS_ARRAY_READ_LF,                   VF_ARRAY_READ,      4, 0},
+  {FLASH_MAIN_MEMORY_PAGE_READ,                      VF_PAGE_READ,       8, 0},
+  {FLASH_BUFFER1_READ,                               VF_BUF_READ,        5, 0},
+  {FLASH_BUFFER1_READ_LF,                            VF_BUF_READ,        4, 0},
+  {FLASH_BUFFER2_READ,                               VF_BUF_READ,        5, 1},
+  {FLASH_BUFFER2_READ_LF,                            VF_BUF_READ,        4, 1},
+  {FLASH_BUFFER1_WRITE,                              VF_BUF_WRITE,       4, 0},
+  {FLASH_BUFFER2_WRITE,                              VF_BUF_WRITE,       4, 1},
+  {FLASH_BUFFER1_TO_MAIN_MEMORY_WRITE_WITH_ERASE,    VF_PROGRAM,         4, 0},
+  {FLASH_BUFFER2_TO_MAIN_MEMORY_WRITE_WITH_ERASE,    VF_PROGRAM,         4, 1},
+  {FLASH_BUFFER1_TO_MAIN_MEMORY_WRITE_WITHOUT_ERASE, VF_PROGRAM_NOERASE, 4, 0},
+  {FLASH_BUFFER2_TO_MAIN_MEMORY_WRITE_WITHOUT_ERASE, VF_PROGRAM_NOERASE, 4, 1},
+  {FLASH_MAIN_MEMORY_PAGE_PROGRAM_THROUGH_BUFFER1,   VF_PROGRAM_THROUGH, 4, 0},
+  {FLASH_MAIN_MEMORY_PAGE_PROGRAM_THROUGH_BUFFER2,   VF_PROGRAM_THROUGH, 4, 1},
+  {FLASH_TRANSFER_MAIN_MEMORY_PAGE_TO_BUFFER1,       VF_TRANSFER,        4, 0},
+  {FLASH_TRANSFER_MAIN_MEMORY_PAGE_TO_BUFFER2,       VF_TRANSFER,        4, 1},
+  {FLASH_COMPARE_MAIN_MEMORY_PAGE_WITH_BUFFER1,      VF_COMPARE,         4, 0},
+  {FLASH_COMPARE_MAIN_MEMORY_PAGE_WITH_BUFFER2,      VF_COMPARE,         4, 1},
+  {FLASH_AUTO_PAGE_REWRITE_BUFFER1,                  VF_REWRITE,         4, 0},
+  {FLASH_AUTO_PAGE_REWRITE_BUFERF2,                  VF_REWRITE,         4, 1},
+  {FLASH_PAGE_ERASE,                                 VF_PAGE_ERASE,      4, 0},
+  {FLASH_BLOCK_ERASE,                                VF_BLOCK_ERASE,     4, 0},
+  {FLASH_SECTOR_ERASE,                               VF_SECTOR_ERASE,    4, 0},
+  {FLASH_BULK_ERASE1,                                VF_CHIP_ERASE,      4, 0},
+  {FLASH_POWER_OF_TWO_PAGE_SIZE1,                    VF_CONFIG,          4, 0},
+  {FLASH_STATUS_REGISTER_READ,                       VF_STATUS,          1, 0},
+  {FLASH_MANUFACTURER_DEVICE_ID_READ,                VF_ID,              1, 0},
+  {FLASH_DEEP_POWER_DOWN,                            VF_POWER_DOWN,      1, 0},
+  {FLASH_DEEP_POWER_DOWN_RESUME,                     VF_RESUME,          1, 0},
+};
+
+/* Stands in for commands that are unknown or not accepted right now,
+   the rest of the transfer is clocked through without effect */
+static const struct vflash_op vflash_nop = {0x00, VF_NONE, 1, 0};
+
+/* State of one emulated chip */
+struct vflash
+{
+  const struct vflash_model *model;
+  bool         enabled;      /* A flash device sits on this chip select */
+  uint8_t     *mem;          /* pages * VFLASH_PAGE_RAW bytes */
+  uint8_t      buf[2][VFLASH_PAGE_RAW];
+  bool         pow2;
+  bool         comp;         /* Last compare found a difference */
+  bool         powered_down;
+  ktime_t      busy_until;   /* Internal operation running until then */
+  int          busy_buf;     /* Buffer it uses, -1 for none */
+  ktime_t      wake_at;      /* End of tRDPD after a resume */
+  /* Command clocked in since chip select went active */
+  const struct vflash_op *op;
+  uint8_t      hdr[VFLASH_HDR_MAX];
+  unsigned int count;
+  unsigned int page;
+  unsigned int offset;
+};
+
+struct spi_vhost
+{
+  struct vflash chip[VHOST_NUM_CS];
+};
+
+/* Controller created by the module itself when there is no device tree */
+static struct platform_device *spi_vhost_pdev;
+
+static unsigned int vflash_page_size(struct vflash *vf)
+{
+  return vf->pow2 ? VFLASH_PAGE_POW2 : VFLASH_PAGE_RAW;
+}
+
+static uint8_t *vflash_page(struct vflash *vf, unsigned int page)
+{
+  return vf->mem + (size_t)page * VFLASH_PAGE_RAW;
+}
+
+static bool vflash_busy(struct vflash *vf)
+{
+  return ktime_before(ktime_get(), vf->busy_until);
+}
+
+/* Start an internal operation, the device reads busy for us */
+static void vflash_start(struct vflash *vf, unsigned int us, int bufno)
+{
+  vf->busy_until = ktime_add_us(ktime_get(), us);
+  vf->busy_buf   = bufno;
+}
+
+static uint8_t vflash_status(struct vflash *vf)
+{
+  uint8_t status = vf->model->density;
+
+  if(!vflash_busy(vf))
+    status |= FLASH_STATUS_READY;
+  if(vf->comp)
+    status |= FLASH_STATUS_COMP;
+  /* Bit 1 (sector protection) stays clear, bit 0 is the page size */
+  if(vf->pow2)
+    status |= 0x01;
+
+  return status;
+}
+
+static void vflash_erase(struct vflash *vf, unsigned int page, unsigned int count)
+{
+  memset(vflash_page(vf, page), 0xFF, (size_t)count * VFLASH_PAGE_RAW);
+}
+
+/* Split the address bytes into page and byte offset. Binary pages use 9
+   offset bits, DataFlash pages 10 */
+static void vflash_decode(struct vflash *vf)
+{
+  unsigned int shift = vf->pow2 ? 9 : 10;
+  uint32_t     addr;
+
+  addr = (vf->hdr[1] << 16) | (vf->hdr[2] << 8) | vf->hdr[3];
+  vf->page   = (addr >> shift) % vf->model->pages;
+  vf->offset = (addr & ((1 << shift) - 1)) % vflash_page_size(vf);
+}
+
+static const struct vflash_op *vflash_lookup(uint8_t opcode)
+{
+  unsigned int ii;
+
+  for(ii = 0; ii < ARRAY_SIZE(vflash_ops); ii++)
+  {
+    if(vflash_ops[ii].opcode == opcode)
+      return &vflash_ops[ii];
+  }
+  return NULL;
+}
+
+/* Opcode byte received, check the chip can take the command right now */
+static const struct vflash_op *vflash_accept(struct vflash *vf, uint8_t opcode)
+{
+  const struct vflash_op *op = vflash_lookup(opcode);
+
+  if(op == NULL)
+  {
+    pr_warn_ratelimited("spi_virtual_host.c   : Unsupported Opcode %02x\r\n", opcode);
+    return &vflash_nop;
+  }
+
+  if(vf->powered_down)
+  {
+    if(op->kind != VF_RESUME)
+      pr_warn_ratelimited("spi_virtual_host.c   : Opcode %02x in Deep Power-Down\r\n", opcode);
+    return (op->kind == VF_RESUME) ? op : &vflash_nop;
+  }
+  if(ktime_before(ktime_get(), vf->wake_at))
+  {
+    pr_warn_ratelimited("spi_virtual_host.c   : Opcode %02x within tRDPD\r\n", opcode);
+    return &vflash_nop;
+  }
+
+  if(!vflash_busy(vf))
+    return op;
+
+  /* While busy only the status register and the other buffer are usable */
+  switch(op->kind)
+  {
+    case VF_STATUS:
+    case VF_ID:
+      return op;
+
+    case VF_BUF_READ:
+    case VF_BUF_WRITE:
+      if(op->bufno != vf->busy_buf)
+        return op;
+      break;
+  }
+  pr_warn_ratelimited("spi_virtual_host.c   : Opcode %02x While Busy\r\n", opcode);
+  return &vflash_nop;
+}
+
+/* Command header complete, set up the data phase */
+static void vflash_begin(struct vflash *vf)
+{
+  if(vf->op->hdr_len >= 4)
+    vflash_decode(vf);
+  if(vf->op->kind == VF_ID)
+    vf->offset = 0;
+}
+
+/* Data phase bytes, reads wrap at the end of the page or buffer and the
+   Continuous Array Read carries on into the next page */
+static void vflash_data(struct vflash *vf, const uint8_t *tx, uint8_t *rx,
+                        size_t len)
+{
+  unsigned int psize = vflash_page_size(vf);
+  unsigned int kind  = vf->op->kind;
+  uint8_t     *area;
+  size_t       chunk, ii;
+
+  switch(kind)
+  {
+    case VF_ARRAY_READ:
+    case VF_PAGE_READ:
+    case VF_BUF_READ:
+    case VF_BUF_WRITE:
+    case VF_PROGRAM_THROUGH:
+      while(len)
+      {
+        chunk = min_t(size_t, len, psize - vf->offset);
+        if(kind == VF_ARRAY_READ || kind == VF_PAGE_READ)
+          area = vflash_page(vf, vf->page) + vf->offset;
+        else
+          area = vf->buf[vf->op->bufno] + vf->offset;
+
+        if(kind == VF_BUF_WRITE || kind == VF_PROGRAM_THROUGH)
+        {
+          if(tx)
+            memcpy(area, tx, chunk);
+          else
+            memset(area, 0, chunk);
+          if(rx)
+            memset(rx, 0xFF, chunk);
+        }
+        else if(rx)
+          memcpy(rx, area, chunk);
+
+        if(tx)
+          tx += chunk;
+        if(rx)
+          rx += chunk;
+        len        -= chunk;
+        vf->offset += chunk;
+        if(vf->offset == psize)
+        {
+          vf->offset = 0;
+          if(kind == VF_ARRAY_READ)
+            vf->page = (vf->page + 1) % vf->model->pages;
+        }
+      }
+      break;
+
+    case VF_STATUS:
+      /* Clocked out again and again as long as CS stays active */
+      if(rx)
+        memset(rx, vflash_status(vf), len);
+      break;
+
+    case VF_ID:
+      for(ii = 0; ii < len; ii++, vf->offset++)
+      {
+        if(rx)
+          rx[ii] = (vf->offset < sizeof(vf->model->id)) ?
+                   vf->model->id[vf->offset] : 0x00;
+      }
+      break;
+
+    default:
+      if(rx)
+        memset(rx, 0xFF, len);
+      break;
+  }
+}
+
+/* Chip select went inactive, which is what starts the internal operation
+   of program, erase, transfer and configuration commands */
+static void vflash_end(struct vflash *vf)
+{
+  const struct vflash_op *op = vf->op;
+  unsigned int psize = vflash_page_size(vf);
+  unsigned int ii, first, count;
+  uint8_t     *page;
+
+  if(op == NULL || vf->count < op->hdr_len)
+    return;
+
+  page = vflash_page(vf, vf->page);
+
+  switch(op->kind)
+  {
+    case VF_PROGRAM:
+    case VF_PROGRAM_THROUGH:
+      vflash_erase(vf, vf->page, 1);
+      memcpy(page, vf->buf[op->bufno], psize);
+      vflash_start(vf, erase_program_us, op->bufno);
+      break;
+
+    case VF_PROGRAM_NOERASE:
+      /* Programming only clears bits */
+      for(ii = 0; ii < psize; ii++)
+        page[ii] &= vf->buf[op->bufno][ii];
+      vflash_start(vf, program_us, op->bufno);
+      break;
+
+    case VF_TRANSFER:
+      memcpy(vf->buf[op->bufno], page, psize);
+      vflash_start(vf, xfer_us, op->bufno);
+      break;
+
+    case VF_COMPARE:
+      vf->comp = (0 != memcmp(vf->buf[op->bufno], page, psize));
+      vflash_start(vf, xfer_us, op->bufno);
+      break;
+
+    case VF_REWRITE:
+      memcpy(vf->buf[op->bufno], page, psize);
+      vflash_start(vf, erase_program_us, op->bufno);
+      break;
+
+    case VF_PAGE_ERASE:
+      vflash_erase(vf, vf->page, 1);
+      vflash_start(vf, page_erase_us, -1);
+      break;
+
+    case VF_BLOCK_ERASE:
+      first = vf->page - (vf->page % VFLASH_BLOCK_PAGES);
+      vflash_erase(vf, first, VFLASH_BLOCK_PAGES);
+      vflash_start(vf, block_erase_us, -1);
+      break;
+
+    case VF_SECTOR_ERASE:
+      /* Sector 0 is split into Sector 0a (the first block) and 0b */
+      if(vf->page < VFLASH_BLOCK_PAGES)
+      {
+        first = 0;
+        count = VFLASH_BLOCK_PAGES;
+      }
+      else if(vf->page < vf->model->sector_pages)
+      {
+        first = VFLASH_BLOCK_PAGES;
+        count = vf->model->sector_pages - VFLASH_BLOCK_PAGES;
+      }
+      else
+      {
+        first = vf->page - (vf->page % vf->model->sector_pages);
+        count = vf->model->sector_pages;
+      }
+      vflash_erase(vf, first, count);
+      vflash_start(vf, sector_erase_us, -1);
+      break;
+
+    case VF_CHIP_ERASE:
+      if(vf->hdr[1] != FLASH_BULK_ERASE2 || vf->hdr[2] != FLASH_BULK_ERASE3 ||
+         vf->hdr[3] != FLASH_BULK_ERASE4)
+        break;
+      vflash_erase(vf, 0, vf->model->pages);
+      vflash_start(vf, chip_erase_us, -1);
+      break;
+
+    case VF_CONFIG:
+      /* Binary page size is one-time programmable. The real part takes
+         it after a power cycle, the model right away. Sector protection
+         and lockdown share the prefix and are not modelled. */
+      if(vf->hdr[1] == FLASH_POWER_OF_TWO_PAGE_SIZE2 &&
+         vf->hdr[2] == FLASH_POWER_OF_TWO_PAGE_SIZE3 &&
+         vf->hdr[3] == FLASH_POWER_OF_TWO_PAGE_SIZE4)
+      {
+        vf->pow2 = true;
+        vflash_start(vf, erase_program_us, -1);
+      }
+      else
+        pr_warn_ratelimited("spi_virtual_host.c   : Unsupported Command %02x %02x %02x %02x\r\n",
+                            vf->hdr[0], vf->hdr[1], vf->hdr[2], vf->hdr[3]);
+      break;
+
+    case VF_POWER_DOWN:
+      vf->powered_down = true;
+      break;
+
+    case VF_RESUME:
+      if(vf->powered_down)
+        vf->wake_at = ktime_add_us(ktime_get(), resume_us);
+      vf->powered_down = false;
+      break;
+  }
 }
 
+/* Clock len bytes through the chip, command header a byte at a time and
+   the data phase in bulk */
+static void vflash_xfer(struct vflash *vf, const uint8_t *tx, uint8_t *rx,
+                        size_t len)
+{
+  uint8_t byte;
+
+  while(len && (vf->op == NULL || vf->count < vf->op->hdr_len))
+  {
+    byte = tx ? *tx++ : 0x00;
+    if(rx)
+      *rx++ = 0xFF;
+    len--;
+
+    if(vf->count < VFLASH_HDR_MAX)
+      vf->hdr[vf->count] = byte;
+    if(vf->count++ == 0)
+      vf->op = vflash_accept(vf, byte);
+
+    if(vf->count == vf->op->hdr_len)
+      vflash_begin(vf);
+  }
+  if(len)
+    vflash_data(vf, tx, rx, len);
+}
 
-/* These hooks are for drivers that want to use the generic  master 
-   transfer queueing mechanism */
-static int spi_vhost_prepare_message(struct spi_master *master, 
-                              struct spi_message *message)
+/* Setup mode and clock, etc (spi driver may call many times).
+   The model is switched on for devices meant for spi_flash.c only */
+static int spi_vhost_setup(struct spi_device *spi)
 {
+  struct spi_vhost *vhost = spi_master_get_devdata(spi->master);
+
   pr_info("spi_virtual_host.c   : %s\r\n",__func__);
+
+  vhost->chip[spi->chip_select].enabled = 
+    of_device_is_compatible(spi->dev.of_node, "atmel,at45db161d") ||
+    of_device_is_compatible(spi->dev.of_node, "atmel,at45") ||
+    0 == strcmp(spi->modalias, VHOST_FLASH_MODALIAS);
   return 0;
 }
 
-/* These hooks are for drivers that use a generic implementation 
+/* Chip select edges frame the commands. The core passes the line level,
+   which is low for an active select unless SPI_CS_HIGH is set */
+static void spi_vhost_set_cs(struct spi_device *spi, bool level)
+{
+  struct spi_vhost *vhost = spi_master_get_devdata(spi->master);
+  struct vflash    *vf    = &vhost->chip[spi->chip_select];
+  bool              active;
+
+  if(!vf->enabled)
+    return;
+
+  active = (spi->mode & SPI_CS_HIGH) ? level : !level;
+  if(!active)
+    vflash_end(vf);
+
+  vf->op    = NULL;
+  vf->count = 0;
+}
+
+/* These hooks are for drivers that use a generic implementation
    of transfer_one_message() provied by the core */
-static int spi_vhost_transfer_one(struct spi_master *master, 
-                           struct spi_device *spi, 
+static int spi_vhost_transfer_one(struct spi_master *master,
+                           struct spi_device *spi,
                            struct spi_transfer *transfer)
 {
-  pr_info("spi_virtual_host.c   : %s\r\n",__func__);
+  struct spi_vhost *vhost = spi_master_get_devdata(master);
+  unsigned int      hz;
+  uint64_t          ns;
+
+  /* Nothing behind other clients, the transfer is only reported */
+  if(!vhost->chip[spi->chip_select].enabled)
+  {
+    pr_info("spi_virtual_host.c   : %s\r\n",__func__);
+    return 0;
+  }
+
+  vflash_xfer(&vhost->chip[spi->chip_select], transfer->tx_buf,
+              transfer->rx_buf, transfer->len);
+
+  /* Optionally take the time the bytes would need on the wire */
+  if(emulate_clock)
+  {
+    hz = transfer->speed_hz ? transfer->speed_hz : spi->max_speed_hz;
+    ns = div_u64((uint64_t)transfer->len * 8 * NSEC_PER_SEC, hz ? hz : VHOST_MAX_SPEED_HZ);
+    if(ns >= 10 * NSEC_PER_USEC)
+      usleep_range(ns / NSEC_PER_USEC, ns / NSEC_PER_USEC + 5);
+    else
+      ndelay(ns);
+  }
+
+  /* Done synchronously, no completion to wait for */
   return 0;
 }
 
 /* Called on release() to free memory provided by spi_master */
 static void spi_vhost_cleanup(struct spi_device *spi)
 {
+  struct spi_vhost *vhost = spi_master_get_devdata(spi->master);
+
   pr_info("spi_virtual_host.c   : %s\r\n",__func__);
+
+  vhost->chip[spi->chip_select].enabled = false;
+}
+
+/* Without a device tree node the flash devices are added here, carrying
+   the properties spi_flash.c would otherwise find in the node */
+static int spi_vhost_add_flash(struct spi_master *master, unsigned int cs)
+{
+  int retval;
+  struct spi_device *spi;
+  struct property_entry props[] = {
+    PROPERTY_ENTRY_U32("reg", cs),
+    PROPERTY_ENTRY_U32("pagesize", VFLASH_PAGE_POW2),
+    PROPERTY_ENTRY_U32("address-width", 24),
+    PROPERTY_ENTRY_U32("spi-max-frequency", VHOST_MAX_SPEED_HZ),
+    { },
+  };
+
+  spi = spi_alloc_device(master);
+  if(spi == NULL)
+    return -ENOMEM;
+
+  strlcpy(spi->modalias, VHOST_FLASH_MODALIAS, sizeof(spi->modalias));
+  spi->chip_select  = cs;
+  spi->max_speed_hz = VHOST_MAX_SPEED_HZ;
+  spi->mode         = SPI_MODE_3;
+
+  retval = device_add_properties(&spi->dev, props);
+  if(retval == 0)
+  {
+    retval = spi_add_device(spi);
+    if(retval == 0)
+      return 0;
+    device_remove_properties(&spi->dev);
+  }
+  spi_dev_put(spi);
+  return retval;
 }
 
 static int spi_vhost_probe(struct platform_device *pdev)
 {
+  int retval;
+  unsigned int cs;
   struct spi_master *master = NULL;
+  struct spi_vhost  *vhost;
+  const struct vflash_model *part = NULL;
 
   pr_info("spi_virtual_host.c   : %s\r\n",__func__);
 
+  for(cs = 0; cs < ARRAY_SIZE(vflash_models); cs++)
+  {
+    if(0 == strcmp(model, vflash_models[cs].name))
+      part = &vflash_models[cs];
+  }
+  if(part == NULL)
+  {
+    pr_info("Unknown Flash Model %s\r\n", model);
+    return -EINVAL;
+  }
+
   /* Instantiate a spi_master structure for the host controller */
   /* @dev : The controller, possibly using the platform_bus.
-     @size: How much zeroed driver-private data to allocate; 
-            The pointer to this memory is in the driver_data field of the 
+     @size: How much zeroed driver-private data to allocate;
+            The pointer to this memory is in the driver_data field of the
             returned device, accessible with spi_master_get_devdata().
   */
   /* So we commonly pass private structure size as the second argument */
-  master = spi_alloc_master(&pdev->dev, 4096);
+  master = spi_alloc_master(&pdev->dev, sizeof(struct spi_vhost));
   if(NULL == master)
   {
     pr_info("SPI Master Allocation Failed\r\n");
     return -ENOMEM;
   }
+  vhost = spi_master_get_devdata(master);
+
+  /* Flash contents, erased to start with */
+  for(cs = 0; cs < VHOST_NUM_CS; cs++)
+  {
+    vhost->chip[cs].model    = part;
+    vhost->chip[cs].pow2     = pow2;
+    vhost->chip[cs].busy_buf = -1;
+    vhost->chip[cs].mem      = vmalloc((size_t)part->pages * VFLASH_PAGE_RAW);
+    if(vhost->chip[cs].mem == NULL)
+    {
+      pr_info("Flash Memory Allocation Failed\r\n");
+      retval = -ENOMEM;
+      goto err_mem;
+    }
+    vflash_erase(&vhost->chip[cs], 0, part->pages);
+  }
+
   /* Allocate the function pointers which directly act on the registers when
      they are invoked */
-  master->setup           = spi_vhost_setup;
-  master->prepare_message = spi_vhost_prepare_message;
-  master->transfer_one    = spi_vhost_transfer_one;
-  master->cleanup         = spi_vhost_cleanup;
-  master->dev.of_node     = pdev->dev.of_node;
- 
+  master->setup              = spi_vhost_setup;
+  master->set_cs             = spi_vhost_set_cs;
+  master->transfer_one       = spi_vhost_transfer_one;
+  master->cleanup            = spi_vhost_cleanup;
+  master->num_chipselect     = VHOST_NUM_CS;
+  master->mode_bits          = SPI_CPOL | SPI_CPHA | SPI_CS_HIGH;
+  master->bits_per_word_mask = SPI_BPW_MASK(8);
+  master->max_speed_hz       = VHOST_MAX_SPEED_HZ;
+  master->dev.of_node        = pdev->dev.of_node;
+  platform_set_drvdata(pdev, master);
+
   /* As our spi_master structure is ready so we now register the structure with
-     the spi core (mid layer) */
-  if(0 > devm_spi_register_master(&pdev->dev, master))
+     the spi core (mid layer). Not device managed, the flash memories have
+     to outlive the devices behind the controller. */
+  retval = spi_register_master(master);
+  if(0 > retval)
   {
     pr_info("SPI Master Registration Failed\r\n");
-    return -ENOMEM;
+    goto err_mem;
+  }
+
+  if(pdev->dev.of_node == NULL)
+  {
+    for(cs = 0; cs < min_t(unsigned int, chips, VHOST_NUM_CS); cs++)
+    {
+      if(0 != spi_vhost_add_flash(master, cs))
+        pr_info("Flash Device %u Registration Failed\r\n", cs);
+    }
   }
+  pr_info("Emulating %s on Flash Chip Selects\r\n", part->name);
+
   return 0;
+
+err_mem:
+  for(cs = 0; cs < VHOST_NUM_CS; cs++)
+    vfree(vhost->chip[cs].mem);
+  spi_master_put(master);
+  return retval;
 }
 
 static int spi_vhost_remove(struct platform_device *pdev)
 {
+  unsigned int cs;
+  struct spi_master *master = platform_get_drvdata(pdev);
+  struct spi_vhost  *vhost  = spi_master_get_devdata(master);
+
   pr_info("spi_virtual_host.c   : %s\r\n",__func__);
+
+  /* The flash devices go away with the master, keep the private data
+     until the memories behind them are freed */
+  spi_master_get(master);
+  spi_unregister_master(master);
+  for(cs = 0; cs < VHOST_NUM_CS; cs++)
+    vfree(vhost->chip[cs].mem);
+  spi_master_put(master);
+
   return 0;
 }
 
@@ -91,7 +762,7 @@ static struct of_device_id spi_vhost_mtable[] = {
   {.compatible = "ti, spi_virtual_host"},
   {},
 };
- 
+
 MODULE_DEVICE_TABLE(of, spi_vhost_mtable);
 
 static struct platform_driver spi_vhost_drv = {
@@ -103,12 +774,38 @@ static struct platform_driver spi_vhost_drv = {
   .remove = spi_vhost_remove,
 };
 
-/* 
-  Helper macro for drivers that don't do anything special in module init/exit.
-  Each module may only use this macro once, and calling it replaces 
-  module_init() and module_exit()
-*/
-module_platform_driver(spi_vhost_drv);
+/* Boards with a device tree get the controller from its node (see dtNode).
+   Elsewhere, an x86 box for instance, the module creates it by itself. */
+static int __init spi_vhost_init(void)
+{
+  int retval;
+
+  retval = platform_driver_register(&spi_vhost_drv);
+  if(retval < 0)
+    return retval;
+
+  if(!of_have_populated_dt())
+  {
+    spi_vhost_pdev = platform_device_register_simple(spi_vhost_drv.driver.name,
+                                                     -1, NULL, 0);
+    if(IS_ERR(spi_vhost_pdev))
+    {
+      platform_driver_unregister(&spi_vhost_drv);
+      return PTR_ERR(spi_vhost_pdev);
+    }
+  }
+  return 0;
+}
+
+static void __exit spi_vhost_exit(void)
+{
+  if(spi_vhost_pdev)
+    platform_device_unregister(spi_vhost_pdev);
+  platform_driver_unregister(&spi_vhost_drv);
+}
+
+module_init(spi_vhost_init);
+module_exit(spi_vhost_exit);
 
 MODULE_DESCRIPTION("Platform Driver for Virtual SPI Host Controller");
 MODULE_AUTHOR("debmalyasarkar1@gmail.com");
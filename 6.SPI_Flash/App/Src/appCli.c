@@ -12,12 +12,15 @@
 #include <fcntl.h>
 #include "../../spi_flash.h"
 
-#define DEVICE_FILE_NAME "/dev/at45db161d" 
+#define DEVICE_FILE_NAME "/dev/at45db161d0" 
 
 #define PAGE_SIZE 512
 
 int fd;
 
+/* Geometry of the opened device, queried at open */
+unsigned int maxPages, pageSize;
+
 extern int quitFlag;
 
 int openFile(int argc,char *argv[])
@@ -28,7 +31,13 @@ int openFile(int argc,char *argv[])
     perror("Open Failed : ");
     return FAILURE;
   }
-  printf("File Open Success\n");
+  if(0 > ioctl(fd, GET_MAX_PAGES, &maxPages) || 0 > ioctl(fd, GET_PAGE_SIZE, &pageSize))
+  {
+    perror("Geometry Query Failed : ");
+    close(fd);
+    return FAILURE;
+  }
+  printf("File Open Success, %u Pages of %u Bytes\n", maxPages, pageSize);
   return SUCCESS;
 }
 
@@ -76,18 +85,32 @@ int readFile(int argc,char *argv[])
 int writeFile(int argc,char *argv[])
 {
   int retval, size = 0;
+  long offset = -1;
   char wrbuff[PAGE_SIZE] = {0};
 
-  if(argc != 2)
+  if(argc != 2 && argc != 3)
   {
-    printf("Usage <CMD> <MessageToWrite>\r\n");
+    printf("Usage <CMD> <MessageToWrite> [ByteOffset]\r\n");
     return FAILURE;
   }
-  strcpy(wrbuff, argv[1]);
+  strncpy(wrbuff, argv[1], PAGE_SIZE - 1);
 
   size = strlen(wrbuff);
 
-  retval = write(fd, wrbuff, size);
+  /* With an offset only the given bytes are rewritten, the rest of the 
+     page is kept as it is */
+  if(argc == 3)
+  {
+    sscanf(argv[2], "%ld", &offset);
+    if(offset < 0)
+    {
+      printf("Offset is Out of Range\r\n");
+      return FAILURE;
+    }
+    retval = pwrite(fd, wrbuff, size, offset);
+  }
+  else
+    retval = write(fd, wrbuff, size);
   if(retval < 0)
   {
     perror("Write Failed : ");
@@ -113,6 +136,8 @@ int closeFile(int argc,char *argv[])
 int ioctlFile(int argc,char *argv[])
 {
   unsigned int  option = 0, cmd = 0, val = 0;
+  struct flash_erase_range range;
+  void *arg = &val;
  
   if(argc < 2)
   {
@@ -125,6 +150,9 @@ int ioctlFile(int argc,char *argv[])
     printf("5   = ERASE_PAGE\n");
     printf("6   = ERASE_SECTOR\n");
     printf("7   = ERASE_CHIP\n");
+    printf("8   = SET_WRITE_MODE (0 = Erase+Program, 1 = Compare)\n");
+    printf("9   = ERASE_RANGE <StartPage> <Count>\n");
+    printf("10  = GET_PAGE_SIZE\n");
 
     return FAILURE;
   }
@@ -136,7 +164,7 @@ int ioctlFile(int argc,char *argv[])
     return FAILURE;
   }
 
-  if((option == 4) || (option == 5) || (option == 6))
+  if((option == 4) || (option == 5) || (option == 6) || (option == 8))
   {
     if(argc != 3)
     {
@@ -146,6 +174,18 @@ int ioctlFile(int argc,char *argv[])
     sscanf(argv[2], "%u", &val);
   }
 
+  if(option == 9)
+  {
+    if(argc != 4)
+    {
+      printf("Missing Start Page or Count\r\n");
+      return FAILURE;
+    }
+    sscanf(argv[2], "%u", &range.start_page);
+    sscanf(argv[3], "%u", &range.count);
+    arg = &range;
+  }
+
   switch(option)
   {
     case 1:
@@ -162,7 +202,7 @@ int ioctlFile(int argc,char *argv[])
 
     case 4:
       cmd = SET_PAGE_OFFSET;
-      if((val < 0) || (val >= 8192))
+      if(val >= maxPages)
       {
         printf("Page Number is Out of Range\r\n");
         return FAILURE;
@@ -171,7 +211,7 @@ int ioctlFile(int argc,char *argv[])
 
     case 5:
       cmd = ERASE_PAGE;
-      if((val < 0) || (val >= 8192))
+      if(val >= maxPages)
       {
         printf("Page Number is Out of Range\r\n");
         return FAILURE;
@@ -179,20 +219,38 @@ int ioctlFile(int argc,char *argv[])
       break;
 
     case 6:
+      /* Sector sizes differ between parts, the driver checks the number */
       cmd = ERASE_SECTOR;
-      if((val < 0) || (val >= 16))
+      break;
+
+    case 7:
+      cmd = ERASE_CHIP;
+      break;
+
+    case 8:
+      cmd = SET_WRITE_MODE;
+      if((val != WRITE_MODE_ERASE_PROGRAM) && (val != WRITE_MODE_COMPARE))
       {
-        printf("Sector Number is Out of Range\r\n");
+        printf("Invalid Write Mode\r\n");
         return FAILURE;
       }
       break;
 
-    case 7:
-      cmd = ERASE_CHIP;
+    case 9:
+      cmd = ERASE_RANGE;
+      if((range.start_page >= maxPages) || (range.count > maxPages - range.start_page))
+      {
+        printf("Page Range is Out of Range\r\n");
+        return FAILURE;
+      }
+      break;
+
+    case 10:
+      cmd = GET_PAGE_SIZE;
       break;
   }
 
-  if(0 > ioctl(fd, cmd, &val))
+  if(0 > ioctl(fd, cmd, arg))
   {
     perror("IOCTL Failed : ");
     return FAILURE;
@@ -204,6 +262,8 @@ int ioctlFile(int argc,char *argv[])
     printf("Max Pages %d\r\n", val);
   else if(option == 3)
     printf("Current Page %d\r\n", val);
+  else if(option == 10)
+    printf("Page Size %d\r\n", val);
   return SUCCESS;
 }
 
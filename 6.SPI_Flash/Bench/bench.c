@@ -0,0 +1,399 @@
+/*
+   Non interactive throughput and latency benchmark for the spi_flash
+   driver. Sweeps access patterns and transfer sizes over a region of the
+   device and prints one result row per (test, size) as CSV or JSON, so
+   runs before and after a driver change can be compared directly. Works
+   the same against real hardware and the virtual SPI host emulator.
+
+   Usage : bench [-d Device] [-t Tests] [-s Sizes] [-n Ops] [-r RegionKB]
+                 [-o OffsetKB] [-f csv|json] [-l Label] [-S Seed] [-y] [-v]
+
+   Tests : seqread, randread, seqwrite, randwrite, rewrite, erase
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "../spi_flash.h"
+
+#define DEVICE_FILE_NAME "/dev/at45db161d0"
+
+#define FAILURE -1
+
+#define MAX_SIZES 16
+
+enum pattern
+{
+  PATTERN_SEQUENTIAL,
+  PATTERN_RANDOM,
+  PATTERN_SAME,        /* Every operation hits the same offset */
+};
+
+enum op
+{
+  OP_READ,
+  OP_WRITE,
+  OP_ERASE,
+};
+
+struct test
+{
+  const char  *name;
+  enum op      op;
+  enum pattern pattern;
+};
+
+static const struct test tests[] = {
+  {"seqread",   OP_READ,  PATTERN_SEQUENTIAL},
+  {"randread",  OP_READ,  PATTERN_RANDOM},
+  {"seqwrite",  OP_WRITE, PATTERN_SEQUENTIAL},
+  {"randwrite", OP_WRITE, PATTERN_RANDOM},
+  {"rewrite",   OP_WRITE, PATTERN_SAME},
+  {"erase",     OP_ERASE, PATTERN_SEQUENTIAL},
+};
+
+/* Command line settings */
+static const char  *device   = DEVICE_FILE_NAME;
+static const char  *label    = "";
+static const char  *testList = "seqread,randread,seqwrite,randwrite,rewrite";
+static unsigned int sizes[MAX_SIZES] = {512, 4096, 65536};
+static unsigned int numSizes = 3;
+static unsigned int numOps   = 256;
+static off_t        regionStart;
+static off_t        regionLen = 512 * 1024;
+static unsigned int seed     = 1;
+static int          json;
+static int          syncWrites;
+static int          verify;
+
+static int fd;
+static int firstRow = 1;
+/* Erases work on whole pages of the device */
+static unsigned int pageSize;
+
+static uint64_t nowNs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmpU64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted samples, p in parts per thousand */
+static double percentileUs(const uint64_t *lat, unsigned int count, unsigned int p)
+{
+  unsigned int idx = (unsigned int)(((uint64_t)count * p + 999) / 1000);
+
+  if(idx == 0)
+    idx = 1;
+  return lat[idx - 1] / 1000.0;
+}
+
+/* Offset of operation ii within the region */
+static off_t pickOffset(enum pattern pattern, unsigned int ii, unsigned int size)
+{
+  off_t slots = regionLen / size;
+
+  switch(pattern)
+  {
+    case PATTERN_SEQUENTIAL:
+      return regionStart + (off_t)(ii % slots) * size;
+    case PATTERN_RANDOM:
+      return regionStart + (off_t)(rand() % slots) * size;
+    default:
+      return regionStart;
+  }
+}
+
+static void fillPattern(uint8_t *buf, unsigned int size, off_t offset, unsigned int ii)
+{
+  unsigned int jj;
+
+  for(jj = 0; jj < size; jj++)
+    buf[jj] = (uint8_t)((offset + jj) * 31 + ii);
+}
+
+static int doOp(enum op op, uint8_t *buf, unsigned int size, off_t offset)
+{
+  struct flash_erase_range range;
+  ssize_t retval;
+
+  switch(op)
+  {
+    case OP_READ:
+      retval = pread(fd, buf, size, offset);
+      break;
+
+    case OP_WRITE:
+      retval = pwrite(fd, buf, size, offset);
+      if(retval == size && syncWrites && 0 > fsync(fd))
+        return FAILURE;
+      break;
+
+    case OP_ERASE:
+      range.start_page = offset / pageSize;
+      range.count      = size / pageSize;
+      return ioctl(fd, ERASE_RANGE, &range);
+
+    default:
+      return FAILURE;
+  }
+  return (retval == size) ? 0 : FAILURE;
+}
+
+static void printRow(const struct test *test, unsigned int size, unsigned int ops,
+                     double seconds, uint64_t *lat)
+{
+  double bytes = (double)ops * size;
+  double mbps  = seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0;
+  double mean  = 0;
+  unsigned int ii;
+
+  for(ii = 0; ii < ops; ii++)
+    mean += lat[ii];
+  mean = mean / ops / 1000.0;
+  qsort(lat, ops, sizeof(*lat), cmpU64);
+
+  if(json)
+  {
+    printf("%s  {\"label\": \"%s\", \"test\": \"%s\", \"size\": %u, \"ops\": %u, "
+           "\"seconds\": %.6f, \"mbps\": %.3f, \"lat_us\": {\"min\": %.1f, "
+           "\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+           "\"max\": %.1f}}", firstRow ? "" : ",\n", label, test->name, size,
+           ops, seconds, mbps, lat[0] / 1000.0, mean, percentileUs(lat, ops, 500),
+           percentileUs(lat, ops, 990), percentileUs(lat, ops, 999),
+           lat[ops - 1] / 1000.0);
+  }
+  else
+  {
+    printf("%s,%s,%u,%u,%.6f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", label,
+           test->name, size, ops, seconds, mbps, lat[0] / 1000.0, mean,
+           percentileUs(lat, ops, 500), percentileUs(lat, ops, 990),
+           percentileUs(lat, ops, 999), lat[ops - 1] / 1000.0);
+  }
+  firstRow = 0;
+  fflush(stdout);
+}
+
+/* Run one test at one size. Writes are followed by an fsync so data held
+   in the driver page cache is part of the measured time. */
+static int runTest(const struct test *test, unsigned int size)
+{
+  unsigned int ii, failed = 0;
+  uint64_t     start, t0, total, *lat;
+  uint8_t     *buf, *check = NULL;
+  off_t        offset;
+
+  if(size > regionLen || (test->op == OP_ERASE && 
+                          (size % pageSize || regionStart % pageSize)))
+  {
+    fprintf(stderr, "%s: size %u skipped\n", test->name, size);
+    return 0;
+  }
+
+  lat = calloc(numOps, sizeof(*lat));
+  buf = malloc(size);
+  if(verify)
+    check = malloc(size);
+  if(lat == NULL || buf == NULL || (verify && check == NULL))
+  {
+    fprintf(stderr, "Out of memory\n");
+    free(lat);
+    free(buf);
+    free(check);
+    return FAILURE;
+  }
+
+  srand(seed);
+  start = nowNs();
+  for(ii = 0; ii < numOps; ii++)
+  {
+    offset = pickOffset(test->pattern, ii, size);
+    if(test->op == OP_WRITE)
+      fillPattern(buf, size, offset, ii);
+
+    t0 = nowNs();
+    if(0 != doOp(test->op, buf, size, offset))
+    {
+      if(test->op == OP_ERASE && errno == EOPNOTSUPP)
+      {
+        fprintf(stderr, "%s: not supported by the device\n", test->name);
+        break;
+      }
+      failed++;
+    }
+    lat[ii] = nowNs() - t0;
+
+    if(verify && test->op == OP_WRITE)
+    {
+      if(size != pread(fd, check, size, offset) || memcmp(buf, check, size))
+        fprintf(stderr, "%s: verify failed at offset %lld\n", test->name,
+                (long long)offset);
+    }
+  }
+  if(test->op == OP_WRITE)
+    fsync(fd);
+  total = nowNs() - start;
+
+  if(failed)
+    fprintf(stderr, "%s: %u of %u operations failed (%s)\n", test->name,
+            failed, numOps, strerror(errno));
+  /* Rows only for clean runs, a partial one would skew comparisons */
+  if(ii == numOps && !failed)
+    printRow(test, size, numOps, total / 1e9, lat);
+
+  free(lat);
+  free(buf);
+  free(check);
+  return failed ? FAILURE : 0;
+}
+
+static void usage(const char *name)
+{
+  printf("Usage %s [-d Device] [-t Tests] [-s Sizes] [-n Ops] [-r RegionKB]\n"
+         "          [-o OffsetKB] [-f csv|json] [-l Label] [-S Seed] [-y] [-v]\n", name);
+  printf("  -d  Device node, default %s\n", DEVICE_FILE_NAME);
+  printf("  -t  Comma separated tests : seqread,randread,seqwrite,randwrite,rewrite,erase\n");
+  printf("  -s  Comma separated transfer sizes in bytes, default 512,4096,65536\n");
+  printf("  -n  Operations per test and size, default %u\n", numOps);
+  printf("  -r  Size of the region used in KB, default %lld\n", (long long)regionLen / 1024);
+  printf("  -o  Start of the region in KB, default 0\n");
+  printf("  -f  Output format, csv (default) or json\n");
+  printf("  -l  Label put on every row, to tell runs apart\n");
+  printf("  -S  Seed for the random offsets, default 1\n");
+  printf("  -y  fsync after every write\n");
+  printf("  -v  Read back and check every write\n");
+  printf("Erase sizes and the region start must be multiples of the page size.\n");
+  printf("Write and erase tests destroy the data in the region.\n");
+}
+
+static int parseSizes(char *arg)
+{
+  char *tok;
+
+  numSizes = 0;
+  for(tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+  {
+    if(numSizes == MAX_SIZES)
+      return FAILURE;
+    sizes[numSizes] = strtoul(tok, NULL, 0);
+    if(sizes[numSizes] == 0)
+      return FAILURE;
+    numSizes++;
+  }
+  return numSizes ? 0 : FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+  int          opt, retval = 0;
+  unsigned int ii, jj;
+  off_t        devSize;
+  char        *list, *tok;
+
+  while((opt = getopt(argc, argv, "d:t:s:n:r:o:f:l:S:yvh")) != -1)
+  {
+    switch(opt)
+    {
+      case 'd': device     = optarg; break;
+      case 't': testList   = optarg; break;
+      case 'n': numOps     = strtoul(optarg, NULL, 0); break;
+      case 'r': regionLen  = (off_t)strtoul(optarg, NULL, 0) * 1024; break;
+      case 'o': regionStart = (off_t)strtoul(optarg, NULL, 0) * 1024; break;
+      case 'l': label      = optarg; break;
+      case 'S': seed       = strtoul(optarg, NULL, 0); break;
+      case 'y': syncWrites = 1; break;
+      case 'v': verify     = 1; break;
+      case 'f':
+        json = (0 == strcmp(optarg, "json"));
+        break;
+      case 's':
+        if(0 != parseSizes(optarg))
+        {
+          printf("Invalid Sizes\r\n");
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if(numOps == 0 || regionLen == 0)
+  {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  fd = open(device, O_RDWR);
+  if(fd < 0)
+  {
+    perror("Open Failed : ");
+    return EXIT_FAILURE;
+  }
+
+  if(0 > ioctl(fd, GET_PAGE_SIZE, &pageSize))
+  {
+    perror("Page Size Query Failed : ");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  /* Keep the region inside the device */
+  devSize = lseek(fd, 0, SEEK_END);
+  if(devSize > 0 && regionStart + regionLen > devSize)
+  {
+    printf("Region is Out of Range, device has %lld bytes\r\n", (long long)devSize);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  if(json)
+    printf("[\n");
+  else
+    printf("label,test,size,ops,seconds,mbps,lat_min_us,lat_mean_us,"
+           "lat_p50_us,lat_p99_us,lat_p999_us,lat_max_us\n");
+
+  /* strtok() needs a writable copy */
+  list = strdup(testList);
+  for(tok = strtok(list, ","); tok; tok = strtok(NULL, ","))
+  {
+    for(ii = 0; ii < sizeof(tests) / sizeof(tests[0]); ii++)
+    {
+      if(0 == strcmp(tok, tests[ii].name))
+        break;
+    }
+    if(ii == sizeof(tests) / sizeof(tests[0]))
+    {
+      fprintf(stderr, "Unknown test %s\n", tok);
+      retval = FAILURE;
+      continue;
+    }
+    for(jj = 0; jj < numSizes; jj++)
+    {
+      if(0 != runTest(&tests[ii], sizes[jj]))
+        retval = FAILURE;
+    }
+  }
+
+  if(json)
+    printf("\n]\n");
+
+  free(list);
+  close(fd);
+  return (retval == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,10 +6,41 @@
 #include <linux/cdev.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
+#include <linux/mtd/mtd.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/genhd.h>
+#include <linux/mm.h>
+#include <linux/radix-tree.h>
+#include <linux/uio.h>
+#include <linux/spinlock.h>
+#include <linux/mmu_context.h>
+#include <linux/sched/mm.h>
+#include <linux/idr.h>
+#include <linux/crc32.h>
+#include <linux/pm_runtime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/kref.h>
 #include "spi_flash.h"
 
+#define CREATE_TRACE_POINTS
+#include "spi_flash_trace.h"
+
 /* 
-   This SPI Driver Supports the 16Mb and 32 MB SPI FLASH memories.
+   This SPI Driver Supports the AT45DB DataFlash family from the 1Mb 
+   AT45DB011D up to the 64Mb AT45DB642D, see flash_geometry[] below.
    16Mb = 16MegaBit = 2MegaByte Organized Into 4096 Pages as follows  
    1 Chip   = 16 Sectors
    1 Sector = 32  Blocks
@@ -17,27 +48,376 @@
    1 Page   = 512 Bytes
      
    32Mb = 32MegaBit = 4MegaByte Organized Into 8192 Pages as follows
-   1 Chip   = 16 Sectors
-   1 Sector = 64  Blocks
+   1 Chip   = 64 Sectors
+   1 Sector = 16  Blocks
    1 Block  = 8   Pages
    1 Page   = 512 Bytes
+
+   In all parts Sector 0 is split into Sector 0a (Block 0) and Sector 0b.
+
+   Each part runs either with power of two pages (256, 512 or 1024 bytes)
+   or with DataFlash pages 1/32 larger (264, 528 or 1056 bytes), picked 
+   with the "pagesize" property. The extra bytes are exposed as ordinary
+   page data, usable as a spare area. The page number sits above the 
+   byte offset in the address, so DataFlash pages take one more offset
+   bit and the layout differs between the two modes.
 */
+/* Internally timed operations, the device is busy until they complete */
+enum flash_op
+{
+  FLASH_OP_NONE = -1,
+  FLASH_OP_TRANSFER,      /* Main memory page to buffer transfer */
+  FLASH_OP_PROGRAM,       /* Buffer to main memory program with erase */
+  FLASH_OP_PAGE_ERASE,
+  FLASH_OP_BLOCK_ERASE,
+  FLASH_OP_SECTOR_ERASE,
+  FLASH_OP_CHIP_ERASE,
+  FLASH_OP_REWRITE,       /* Auto Page Rewrite through a buffer */
+  FLASH_OP_MAX,
+};
+
+/* Typical and maximum completion times from the AT45DB161D datasheet */
+struct flash_op_timing
+{
+  const char  *name;
+  unsigned int typ_us;
+  unsigned int max_us;
+};
+
+static const struct flash_op_timing op_timing[FLASH_OP_MAX] = {
+  [FLASH_OP_TRANSFER]     = {"transfer",     200,       400},
+  [FLASH_OP_PROGRAM]      = {"program",      14000,     35000},
+  [FLASH_OP_PAGE_ERASE]   = {"page erase",   13000,     32000},
+  [FLASH_OP_BLOCK_ERASE]  = {"block erase",  30000,     75000},
+  [FLASH_OP_SECTOR_ERASE] = {"sector erase", 700000,    1300000},
+  [FLASH_OP_CHIP_ERASE]   = {"chip erase",   12000000,  22000000},
+  [FLASH_OP_REWRITE]      = {"page rewrite", 17000,     40000},
+};
+
+/* Measured completion times of each operation class */
+struct flash_op_stats
+{
+  unsigned int count;
+  unsigned int last_us;
+  unsigned int avg_us;
+  unsigned int max_us;
+  uint64_t     total_us;
+};
+
+/* Counters kept in debugfs, see spi_flash_debugfs_init() */
+enum flash_stat
+{
+  FLASH_STAT_READS,         /* Array reads */
+  FLASH_STAT_WRITES,        /* Page programs */
+  FLASH_STAT_PAGE_ERASES,
+  FLASH_STAT_BLOCK_ERASES,
+  FLASH_STAT_SECTOR_ERASES,
+  FLASH_STAT_CHIP_ERASES,
+  FLASH_STAT_READ_BYTES,
+  FLASH_STAT_WRITE_BYTES,   /* Into the SRAM buffers */
+  FLASH_STAT_BUSY_US,       /* Spent waiting for the device to get ready */
+  FLASH_STAT_RETRIES,       /* Non blocking requests sent back with -EAGAIN */
+  FLASH_STAT_ERRORS,        /* Failed transfers and ready timeouts */
+  FLASH_STAT_MAX,
+};
+
+static const char * const stat_names[FLASH_STAT_MAX] = {
+  [FLASH_STAT_READS]         = "reads",
+  [FLASH_STAT_WRITES]        = "writes",
+  [FLASH_STAT_PAGE_ERASES]   = "page_erases",
+  [FLASH_STAT_BLOCK_ERASES]  = "block_erases",
+  [FLASH_STAT_SECTOR_ERASES] = "sector_erases",
+  [FLASH_STAT_CHIP_ERASES]   = "chip_erases",
+  [FLASH_STAT_READ_BYTES]    = "read_bytes",
+  [FLASH_STAT_WRITE_BYTES]   = "write_bytes",
+  [FLASH_STAT_BUSY_US]       = "busy_us",
+  [FLASH_STAT_RETRIES]       = "retries",
+  [FLASH_STAT_ERRORS]        = "errors",
+};
+
+/* Latency histogram classes, the internally timed operations followed
+   by the plain bus transfers */
+enum flash_lat
+{
+  FLASH_LAT_READ = FLASH_OP_MAX,  /* Array read */
+  FLASH_LAT_BUFFER,               /* SRAM buffer write */
+  FLASH_LAT_MAX,
+};
+
+/* Bucket n counts latencies of 2^(n-1) up to 2^n - 1 us, bucket 0 those
+   under 1 us */
+#define FLASH_LAT_BUCKETS 32
+
+/* Per-CPU so completions from any context count without a lock, summed
+   when read */
+struct flash_stats
+{
+  u64 count[FLASH_STAT_MAX];
+  u64 hist[FLASH_LAT_MAX][FLASH_LAT_BUCKETS];
+};
+
+/* Data to be programmed into one page through an SRAM buffer, len bytes
+   at byte offset within the page. Bytes outside that range keep their 
+   old contents. A page known to be erased is programmed without the 
+   built-in erase. */
+struct flash_prog
+{
+  unsigned int   page;
+  unsigned int   offset;
+  const uint8_t *data;
+  size_t         len;
+  bool           erased;
+};
+
+/* Cached copy of one flash page */
+struct flash_cache_page
+{
+  struct list_head  lru;    /* Most recently used first */
+  struct hlist_node hash;
+  unsigned int      page;
+  bool              dirty;
+  unsigned int      dirty_start;  /* Bytes dirty_start .. dirty_end - 1 */
+  unsigned int      dirty_end;    /* are newer than the flash */
+  /* Read straight from the bus, so kept off the cache lines of the header */
+  uint8_t           data[] __aligned(ARCH_KMALLOC_MINALIGN);
+};
+
+/* DMA-safe buffer set for one bus transaction. Both buffers come from
+   kmalloc so they are cache line aligned and never share a line with other
+   data, which lets the controller map them for DMA without bouncing. */
+struct flash_xfer
+{
+  struct list_head list;
+  uint8_t         *cmd;   /* Opcode, address and dummy bytes */
+  uint8_t         *data;  /* Up to FLASH_READ_CHUNK bytes */
+};
+
+/* Request in the asynchronous submission queue */
+struct flash_aio
+{
+  struct spi_flash_prv *prv;
+  struct list_head    list;
+  struct work_struct  work;
+  struct kiocb       *iocb;
+  struct iov_iter     iter;
+  const void         *iov;
+  struct mm_struct   *mm;
+  bool                write;
+  loff_t              pos;
+  size_t              len;
+  ssize_t             result;
+  struct flash_xfer  *xfer;
+  ktime_t             start;
+  struct spi_transfer t[2];
+  struct spi_message  m;
+};
+
+/* Geometry of one AT45DB part, keyed by the density code in the ID */
+struct flash_geometry
+{
+  uint8_t      density;
+  const char  *name;
+  unsigned int pages;
+  unsigned int sector_pages;    /* Pages per sector, past Sector 0 */
+  unsigned int binary_page;     /* Power of two page size */
+  unsigned int dataflash_page;  /* DataFlash page size */
+  unsigned int offset_bits;     /* Byte offset bits of a DataFlash page */
+};
+
+static const struct flash_geometry flash_geometry[] = {
+  {0x02, "AT45DB011D",  512, 128,  256,  264,  9},
+  {0x03, "AT45DB021D", 1024, 128,  256,  264,  9},
+  {0x04, "AT45DB041D", 2048, 256,  256,  264,  9},
+  {0x05, "AT45DB081D", 4096, 256,  256,  264,  9},
+  {0x06, "AT45DB161D", 4096, 256,  512,  528, 10},
+  {0x07, "AT45DB321D", 8192, 128,  512,  528, 10},
+  {0x08, "AT45DB642D", 8192, 256, 1024, 1056, 11},
+};
+
 struct spi_flash_prv
 {
   struct spi_device *spidev;
-  unsigned int inuse;
+  int                id;
+  /* Held by the bound device, open files and mappings, see spi_flash_free() */
+  struct kref        ref;
+  bool               gone;      /* Set by remove, under the bus lock */
+  char               name[16];
+  struct miscdevice  misc;
   unsigned int reg;
   unsigned int page_size;
   unsigned int address_width;
   unsigned int spi_max_frequency;
+  unsigned int cmd_hz;          /* Clock for commands and buffer access */
+  unsigned int read_hz;         /* Clock for array reads */
+  uint8_t      read_opcode;
+  unsigned int read_cmd_len;
   unsigned int device_id;
   unsigned int max_pages;
-  unsigned int current_page;
+  unsigned int sector_pages;
+  const struct flash_geometry *geo;
+  unsigned int page_shift;      /* Page number position in an address */
+  int          busy_op;
+  ktime_t      busy_start;
+  uint8_t      busy_cmd;        /* Command and page that started busy_op */
+  int          busy_page;
+  struct flash_op_stats op_stats[FLASH_OP_MAX];
+  struct flash_stats __percpu *stats;
+  struct dentry      *debugfs;
+  unsigned int next_buffer;
+  unsigned int write_mode;
+  unsigned int status;
+  /* Bus access. Readers share it, anything issuing program or erase 
+     commands or changing driver state holds it exclusively, so the 
+     device is always ready for a read while it is held shared */
+  struct rw_semaphore lock;
+  /* Page cache and mmap page lists, which shared holders also update */
+  struct mutex cache_lock;
+  DECLARE_HASHTABLE(cache_hash, 8);
+  struct list_head    cache_lru;
+  unsigned int        cache_count;
+  unsigned int        cache_dirty;
+  unsigned int        cache_max;
+  struct delayed_work flush_work;
+  struct file_ra_state ra;         /* Read-ahead of MTD and block users */
+  /* Auto Page Rewrite maintenance, see rewrite_note() */
+  unsigned int       *rewrite_count;  /* Page programs and erases per sector */
+  unsigned int        rewrite_sector; /* Sector being swept, UINT_MAX if none */
+  unsigned int        rewrite_page;   /* Next page of the sweep */
+  unsigned int        rewrite_base;   /* Its count when the sweep started */
+  unsigned long       last_io;        /* jiffies of the last foreground I/O */
+  struct delayed_work rewrite_work;
+  /* Bytes seen through the device nodes, the whole chip or the FTL space */
+  loff_t              size;
+  /* Flash Translation Layer, see ftl_write() */
+  bool                ftl;
+  unsigned int        ftl_pages;   /* Logical pages */
+  uint32_t           *ftl_map;     /* Logical to physical page */
+  uint8_t            *ftl_state;   /* enum ftl_page_state per physical page */
+  unsigned int        ftl_free;    /* Erased physical pages */
+  unsigned int        ftl_stale;   /* Physical pages waiting for an erase */
+  unsigned int        ftl_next;    /* Head of the log */
+  uint32_t            ftl_seq;
+  uint8_t            *ftl_buf;     /* Image of the page being programmed */
+  struct delayed_work ftl_gc_work;
+  struct mtd_info     mtd;
+  wait_queue_head_t   mtd_wait;    /* Woken as MTD users go away */
+  int                   blk_major;
+  struct blk_mq_tag_set tag_set;
+  struct request_queue *queue;
+  struct gendisk       *disk;
+  /* Kernel pages backing mmap(), indexed by PAGE_SIZE offset */
+  struct radix_tree_root mmap_pages;
+  /* Asynchronous submission queue */
+  struct workqueue_struct *aio_wq;
+  struct work_struct       aio_work;
+  spinlock_t               aio_lock;
+  struct list_head         aio_queue;
+  atomic_t                 aio_inflight;
+  atomic_t                 aio_pending;
+  struct completion        aio_done;
+  wait_queue_head_t        aio_wait;
+  /* Command and status bytes of the bus lock holder */
+  uint8_t                 *cmd;
+  /* Preallocated transfer buffers shared by readers, writers and AIO */
+  struct flash_xfer       *xfer;
+  unsigned int             xfer_count;
+  struct list_head         xfer_free;
+  spinlock_t               xfer_lock;
+  wait_queue_head_t        xfer_wait;
 };
 
-struct spi_flash_prv *prv = NULL;
+/* Numbers the device nodes of the chips found, at45db161d0, 1, ... */
+static DEFINE_IDA(spi_flash_ida);
+
+/* Largest range streamed by one Continuous Array Read command */
+#define FLASH_READ_CHUNK (32 * 1024)
+
+/* Pages handed to the pipelined program engine per call */
+#define FLASH_PROG_BATCH 8
+
+/* Reads up to this size are pulled into the page cache */
+#define FLASH_CACHE_FILL_MAX (4 * 512)
+
+static unsigned int cache_kb = 64;
+module_param(cache_kb, uint, 0444);
+MODULE_PARM_DESC(cache_kb, "Page cache memory budget in KB, 0 disables caching");
+
+static unsigned int flush_ms = 1000;
+module_param(flush_ms, uint, 0644);
+MODULE_PARM_DESC(flush_ms, "Delay before dirty cached pages are written back");
+
+static bool ftl;
+module_param(ftl, bool, 0444);
+MODULE_PARM_DESC(ftl, "Expose the chips through the wear levelling translation layer");
+
+static unsigned int xfer_buffers = 8;
+module_param(xfer_buffers, uint, 0444);
+MODULE_PARM_DESC(xfer_buffers, "Preallocated DMA-safe transfer buffers");
+
+static unsigned int aio_depth = 16;
+module_param(aio_depth, uint, 0644);
+MODULE_PARM_DESC(aio_depth, "Asynchronous requests allowed in flight");
+
+static unsigned int readahead_kb = 16;
+module_param(readahead_kb, uint, 0644);
+MODULE_PARM_DESC(readahead_kb, "Largest sequential read-ahead window in KB, 0 disables it");
+
+static unsigned int rewrite_idle_ms = 50;
+module_param(rewrite_idle_ms, uint, 0644);
+MODULE_PARM_DESC(rewrite_idle_ms, "Quiet time before background page rewrites run");
+
+static unsigned int autosuspend_ms = 100;
+module_param(autosuspend_ms, uint, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time before a chip enters Deep Power-Down");
+
+/* RWF_NOWAIT requests must not block on the bus lock or on flash I/O */
+#ifdef IOCB_NOWAIT
+#define iocb_nowait(iocb) ((iocb)->ki_flags & IOCB_NOWAIT)
+#else
+#define iocb_nowait(iocb) (false)
+#endif
+
+/* Pages in an erase block */
+#define FLASH_BLOCK_PAGES 8
+
+/* Block device minors, the whole disk plus partitions */
+#define FLASH_BLK_MINORS 8
+
+/* Opcode, three address bytes and the dummy byte of an array read */
+#define FLASH_READ_CMD_LEN 5
+
+/* Clock limits common to the AT45DB family. fSCK holds for all commands
+   and the high frequency Continuous Array Read (fCAR1), the low frequency
+   read without dummy byte only runs up to fCAR2. */
+#define FLASH_FSCK_HZ  66000000
+#define FLASH_FCAR1_HZ 66000000
+#define FLASH_FCAR2_HZ 33000000
+
+/* Sector program and erase counts at which the page rewrite sweep is 
+   started, and past which it no longer waits for idle windows. The 
+   datasheet limit is 10,000. */
+#define FLASH_REWRITE_DUE    8000
+#define FLASH_REWRITE_URGENT 9500
 
-static int get_device_properties(void)
+/* Pages rewritten per hold of the bus lock */
+#define FLASH_REWRITE_BATCH  8
+
+/* Smallest read-ahead window in pages, it doubles up to readahead_kb */
+#define FLASH_RA_MIN_PAGES 4
+
+/* Response bytes sit one cache line after the command in prv->cmd */
+#define FLASH_CMD_RX L1_CACHE_BYTES
+
+/* Status is polled back to back for this long before sleeping */
+#define FLASH_READY_SPIN_US  50
+/* Shortest sleep between status polls once the expected time has passed */
+#define FLASH_READY_SLICE_US 20
+
+/* Deep Power-Down entry (tEDPD) and resume (tRDPD) times */
+#define FLASH_TEDPD_US 3
+#define FLASH_TRDPD_US 35
+
+static int get_device_properties(struct spi_flash_prv *prv)
 {
   /* Read and Print SPI Device Properties from the Device Tree Node */
   if(0 != device_property_read_u32(&prv->spidev->dev, "reg", &prv->reg))
@@ -69,320 +449,2606 @@ static int get_device_properties(void)
   return SUCCESS;
 }
 
-/* Read Manufacturer Device ID and Get Chip Information */
-static unsigned int get_device_id(void)
+/* Pick the clocks from the "spi-max-frequency" property, the controller
+   limit and the part. Commands sent with plain spi_write() run at the
+   device max_speed_hz, array reads set their clock per transfer. The 
+   low frequency read saves the dummy byte, so it is used whenever the 
+   bus is too slow to gain from the high frequency one. */
+static int set_clocks(struct spi_flash_prv *prv)
 {
-  uint8_t cmd[1];
-  uint8_t devInfo[4] = {0}, capacity = 0;  
+  struct spi_device *spidev = prv->spidev;
+  unsigned int       bus_hz = FLASH_FSCK_HZ;
 
-  cmd[0] =  FLASH_MANUFACTURER_DEVICE_ID_READ;
+  if(prv->spi_max_frequency)
+    bus_hz = min(bus_hz, prv->spi_max_frequency);
+  if(spidev->master->max_speed_hz)
+    bus_hz = min(bus_hz, spidev->master->max_speed_hz);
 
-  spi_write_then_read(prv->spidev, cmd, 1, devInfo, 4);
-
-  if(devInfo[0] == 0x1F &&(devInfo[1] & 0xE0) == 0x20)
+  prv->cmd_hz = bus_hz;
+  if(bus_hz > FLASH_FCAR2_HZ)
   {
-    pr_info("Valid SPI Flash\r\n");	
-    capacity=devInfo[1] & 0x1F;
-    if(capacity == 0x06)      //16Mbit
-    {
-      pr_info("16Mbit Capacity\r\n");
-      prv->max_pages = 4096;
-    }
-    else if(capacity == 0x07) //32Mbit
-    {
-      pr_info("32Mbit Capacity\r\n");
-      prv->max_pages = 8192;
-    }
-    else
-    {	
-      pr_info("Invalid SPI Flash Capacity\r\n");
-      return -EINVAL;
-    }
+    prv->read_opcode  = FLASH_CONTINUOUS_ARRAY_READ_HF;
+    prv->read_cmd_len = FLASH_READ_CMD_LEN;
+    prv->read_hz      = min(bus_hz, (unsigned int)FLASH_FCAR1_HZ);
   }
+  else
+  {
+    prv->read_opcode  = FLASH_CONTINUOUS_ARRAY_READ_LF;
+    prv->read_cmd_len = FLASH_READ_CMD_LEN - 1;
+    prv->read_hz      = bus_hz;
+  }
+  pr_info("Command Clock = %d Hz, Read Clock = %d Hz (%02x)\r\n",
+          prv->cmd_hz, prv->read_hz, prv->read_opcode);
 
-  prv->device_id = (devInfo[0] << 24) | (devInfo[1] << 16) | 
-                   (devInfo[2] << 8) | (devInfo[3] << 0);
-  pr_info("Device ID %x\n", prv->device_id);
-
-  return SUCCESS;
+  spidev->max_speed_hz = prv->cmd_hz;
+  return spi_setup(spidev);
 }
 
-/* Setting Page Size as 512 */
-static unsigned int set_page_size(void)
+static void stat_latency(struct spi_flash_prv *prv, int lat, s64 us)
 {
-  unsigned int status;
-  uint8_t buff[4];
-
-  buff[0] = FLASH_POWER_OF_TWO_PAGE_SIZE1;
-  buff[1] = FLASH_POWER_OF_TWO_PAGE_SIZE2;
-  buff[2] = FLASH_POWER_OF_TWO_PAGE_SIZE3; 
-  buff[3] = FLASH_POWER_OF_TWO_PAGE_SIZE4;
- 
-  status = spi_write(prv->spidev, buff, 4);
+  unsigned int bucket = 0;
 
-  return status;
+  if(us > 0)
+    bucket = min_t(unsigned int, ilog2(us) + 1, FLASH_LAT_BUCKETS - 1);
+  this_cpu_inc(prv->stats->hist[lat][bucket]);
 }
 
-/* Single Page Erase */
-static unsigned int erase_page(unsigned int page_no)
+/* Count a finished array read or buffer write */
+static void stat_xfer(struct spi_flash_prv *prv, int lat, unsigned int len,
+                      s64 ns, int status)
 {
-  uint32_t addr, retval;
-  uint8_t  cmd[4] = {0};
-  
-  cmd[0] = FLASH_PAGE_ERASE;
-  /* Bits 0 - 8  (9  Bits) --> Address 512  bytes in a page */
-  /* Bits 9 - 21 (13 Bits) --> Address 8192 pages */
-  addr = page_no << 9;
-  cmd[1] = ((addr >> 16) & 0xFF);
-  cmd[2] = ((addr >> 8)  & 0xFF);
-  cmd[3] = ((addr >> 0)  & 0xFF);
+  if(0 != status)
+    return;
 
-  retval = spi_write(prv->spidev, cmd, 4);
-  if(0 != retval)
+  if(lat == FLASH_LAT_READ)
   {
-    pr_info("SPI Failed\r\n");
-    return retval;
+    this_cpu_inc(prv->stats->count[FLASH_STAT_READS]);
+    this_cpu_add(prv->stats->count[FLASH_STAT_READ_BYTES], len);
   }
-  return SUCCESS;
+  else
+    this_cpu_add(prv->stats->count[FLASH_STAT_WRITE_BYTES], len);
+  stat_latency(prv, lat, div_s64(ns, NSEC_PER_USEC));
 }
 
-/* Sector Erase */
-static unsigned int erase_sector(unsigned int sector_no)
+/* Count an internally timed operation once the device is ready again */
+static void stat_busy(struct spi_flash_prv *prv, enum flash_op op, s64 us)
 {
-  uint32_t addr, retval;
-  uint8_t  cmd[4] = {0};
-
-  cmd[0] = FLASH_SECTOR_ERASE;
-  /* Bits 0 - 8  (9  Bits) --> Address 512  bytes in a page */
-  /* Bits 9 - 21 (13 Bits) --> Address 8192 pages */
-  addr = sector_no << 9;
-  cmd[1] = ((addr >> 16) & 0xFF);
-  cmd[2] = ((addr >> 8)  & 0xFF);
-  cmd[3] = ((addr >> 0)  & 0xFF);
-
-  retval = spi_write(prv->spidev, cmd, 4);
-  if(0 != retval)
+  switch(op)
   {
-    pr_info("SPI Failed\r\n");
-    return retval;
+    case FLASH_OP_PROGRAM:
+      this_cpu_inc(prv->stats->count[FLASH_STAT_WRITES]);
+      break;
+    case FLASH_OP_PAGE_ERASE:
+      this_cpu_inc(prv->stats->count[FLASH_STAT_PAGE_ERASES]);
+      break;
+    case FLASH_OP_BLOCK_ERASE:
+      this_cpu_inc(prv->stats->count[FLASH_STAT_BLOCK_ERASES]);
+      break;
+    case FLASH_OP_SECTOR_ERASE:
+      this_cpu_inc(prv->stats->count[FLASH_STAT_SECTOR_ERASES]);
+      break;
+    case FLASH_OP_CHIP_ERASE:
+      this_cpu_inc(prv->stats->count[FLASH_STAT_CHIP_ERASES]);
+      break;
+    default:
+      break;
   }
-  return SUCCESS;
+  this_cpu_add(prv->stats->count[FLASH_STAT_BUSY_US], us);
+  stat_latency(prv, op, us);
 }
 
-/* Full Chip Erase */
-static unsigned int erase_chip(void)
+/* spi_sync() of a message carrying one command, traced with its 
+   duration. len counts the data bytes past the command. Array reads 
+   and buffer writes are counted under their latency class lat, other
+   commands pass FLASH_OP_NONE. */
+static int flash_sync(struct spi_flash_prv *prv, struct spi_message *m,
+                      uint8_t opcode, int page, unsigned int len, int lat)
 {
-  uint32_t retval;
-  uint8_t  cmd[4] = {0};
+  int     retval;
+  s64     ns;
+  ktime_t start = 0;
 
-  cmd[0] = FLASH_BULK_ERASE1;
-  cmd[1] = FLASH_BULK_ERASE2;
-  cmd[2] = FLASH_BULK_ERASE3;
-  cmd[3] = FLASH_BULK_ERASE4;
+  if(lat != FLASH_OP_NONE || trace_spi_flash_cmd_complete_enabled())
+    start = ktime_get();
+  trace_spi_flash_cmd_issue(prv->name, opcode, page, len);
+
+  retval = spi_sync(prv->spidev, m);
 
-  retval = spi_write(prv->spidev, cmd, 4);
   if(0 != retval)
+    this_cpu_inc(prv->stats->count[FLASH_STAT_ERRORS]);
+  if(lat != FLASH_OP_NONE || trace_spi_flash_cmd_complete_enabled())
   {
-    pr_info("SPI Failed\r\n");
-    return retval;
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    if(lat != FLASH_OP_NONE)
+      stat_xfer(prv, lat, len, ns, retval);
+    trace_spi_flash_cmd_complete(prv->name, opcode, page, len, ns, retval, 0);
   }
-  return SUCCESS;
-
+  return retval;
 }
 
-static int device_open(struct inode *inode, struct file *file)
+/* Send the len command bytes in prv->cmd on their own */
+static int command_write(struct spi_flash_prv *prv, size_t len)
 {
-  pr_info("Open Operation Invoked\r\n");
+  struct spi_transfer t;
+  struct spi_message  m;
 
-  if(prv->inuse)
-  {
-    pr_info("Device Busy %s\r\n",DEVICE_NAME);
-    return -EBUSY;
-  }
-  prv->inuse = 1;
-  
-  /* Check Device ID */
-  if(SUCCESS != get_device_id())
-    return -EINVAL;
+  memset(&t, 0, sizeof(t));
+  t.tx_buf = prv->cmd;
+  t.len    = len;
+  spi_message_init_with_transfers(&m, &t, 1);
 
-  /* Set Page Size to 512 */
-  if(SUCCESS != set_page_size())
-  {
-    pr_info("Page Size Setting Failed\r\n");
-    return -EINVAL;
-  }
-  return SUCCESS;
+  return flash_sync(prv, &m, prv->cmd[0], -1, 0, FLASH_OP_NONE);
 }
 
-static int device_release(struct inode *inode, struct file *file)
+/* Send the len command bytes in prv->cmd starting an internally timed
+   operation. wait_ready() traces its completion, unless the command 
+   already failed on the bus. */
+static int command_start(struct spi_flash_prv *prv, size_t len, int page)
 {
-  pr_info("Release Operation Invoked\r\n");
+  int retval;
 
-  prv->inuse = 0;
+  prv->busy_cmd  = prv->cmd[0];
+  prv->busy_page = page;
+  trace_spi_flash_cmd_issue(prv->name, prv->cmd[0], page, 0);
 
-  return SUCCESS;
+  retval = spi_write(prv->spidev, prv->cmd, len);
+  if(0 != retval)
+  {
+    this_cpu_inc(prv->stats->count[FLASH_STAT_ERRORS]);
+    trace_spi_flash_cmd_complete(prv->name, prv->cmd[0], page, 0, 0, retval, 0);
+  }
+  return retval;
 }
 
-static ssize_t device_read(struct file *filp, char __user *buf, size_t size, loff_t *ppos)
+/* Send txlen command bytes from prv->cmd and read rxlen response bytes 
+   into prv->cmd + FLASH_CMD_RX, both sides in the same message */
+static int command_read(struct spi_flash_prv *prv, size_t txlen, size_t rxlen)
 {
-  uint32_t addr, retval;
-  uint8_t  cmd[8]   = {0};
-  uint8_t  tmp[512] = {0};
-
   struct spi_transfer t[2];
   struct spi_message  m;
 
-  pr_info("Read Operation Invoked\r\n");
-
-  cmd[0] = FLASH_MAIN_MEMORY_PAGE_READ;
-
-  /* Bits 0 - 8  (9  Bits) --> Address 512  bytes in a page */
-  /* Bits 9 - 21 (13 Bits) --> Address 8192 pages */
-  addr = prv->current_page << 9;
- 
-  cmd[1] = ((addr >> 16) & 0xFF);
-  cmd[2] = ((addr >> 8)  & 0xFF);
-  cmd[3] = ((addr >> 0)  & 0xFF);
-  
-  /* Initialie spi_message list */
-  spi_message_init(&m);  
-
-  /* Initialize spi_transfer structure with 0 */
+  spi_message_init(&m);
   memset(t, 0, sizeof(t));
 
-  /* Four dummy bytes are to be needed after address so we write 8 bytes */
-  t[0].tx_buf = cmd;
-  t[0].len    = sizeof(cmd);
+  t[0].tx_buf = prv->cmd;
+  t[0].len    = txlen;
   spi_message_add_tail(&t[0], &m);
 
-  /* We read the data into a local buffer */
-  t[1].rx_buf = tmp;
-  t[1].len    = size;
+  t[1].rx_buf = prv->cmd + FLASH_CMD_RX;
+  t[1].len    = rxlen;
   spi_message_add_tail(&t[1], &m);
 
-  /* Initiate SPI Transfer */
-  retval = spi_sync(prv->spidev, &m);
-  if(0 != retval)
-  {
-    pr_info("SPI Failed\r\n");
-    return retval;
-  }
-  /* Note: We could have used spi_write_then_read() variant and skip using 
-           spi_message and spi_transfer structures but that method is not 
-           portable and should not be used to transfer more than 32 bytes */
-  
-  /* Safely copy data from temporary buffer to the user buffer */
-  retval = copy_to_user(buf, tmp, size);
-  if(0 != retval)
+  return flash_sync(prv, &m, prv->cmd[0], -1, rxlen, FLASH_OP_NONE);
+}
+
+/* Read Manufacturer Device ID and Get Chip Information */
+static unsigned int get_device_id(struct spi_flash_prv *prv)
+{
+  uint8_t *devInfo = prv->cmd + FLASH_CMD_RX, capacity = 0;
+  unsigned int ii;
+
+  prv->cmd[0] = FLASH_MANUFACTURER_DEVICE_ID_READ;
+
+  memset(devInfo, 0, 4);
+  command_read(prv, 1, 4);
+
+  if(devInfo[0] == 0x1F &&(devInfo[1] & 0xE0) == 0x20)
   {
-    pr_info("Partial Copy\r\n");
-    return retval;
+    pr_info("Valid SPI Flash\r\n");	
+    capacity=devInfo[1] & 0x1F;
+    for(ii = 0; ii < ARRAY_SIZE(flash_geometry); ii++)
+      if(flash_geometry[ii].density == capacity)
+        prv->geo = &flash_geometry[ii];
+    if(prv->geo == NULL)
+    {	
+      pr_info("Invalid SPI Flash Capacity\r\n");
+      return -EINVAL;
+    }
+    pr_info("%s, %d Pages\r\n", prv->geo->name, prv->geo->pages);
+    prv->max_pages    = prv->geo->pages;
+    prv->sector_pages = prv->geo->sector_pages;
   }
+
+  prv->device_id = (devInfo[0] << 24) | (devInfo[1] << 16) | 
+                   (devInfo[2] << 8) | (devInfo[3] << 0);
+  pr_info("Device ID %x\n", prv->device_id);
+
   return SUCCESS;
 }
 
-static ssize_t device_write(struct file *filp, const char __user *buf, size_t size, loff_t *ppos)
+/* Enter Deep Power-Down, only the resume command is accepted after it */
+static int power_down(struct spi_flash_prv *prv)
 {
-  uint32_t addr, retval;
-  uint8_t  cmd[516] = {0};
-  struct spi_transfer t;
-  struct spi_message  m;
+  int retval;
+
+  prv->cmd[0] = FLASH_DEEP_POWER_DOWN;
 
-  pr_info("Write Operation Invoked\r\n");
+  retval = command_write(prv, 1);
+  if(0 != retval)
+    return retval;
 
-/* We are using Internal Buffer 2 */
-/* S1 : Read from Main Memory to Buffer 2 */
-  cmd[0] = FLASH_TRANSFER_MAIN_MEMORY_PAGE_TO_BUFFER2;
+  /* A resume right after must not overlap the entry */
+  udelay(FLASH_TEDPD_US);
+  return SUCCESS;
+}
 
-  /* Bits 0 - 8  (9  Bits) --> Address 512  bytes in a page */
-  /* Bits 9 - 21 (13 Bits) --> Address 8192 pages */
-  addr = prv->current_page << 9;
+/* Resume from Deep Power-Down, commands are accepted again after tRDPD.
+   Harmless when the chip is already awake. */
+static int power_up(struct spi_flash_prv *prv)
+{
+  int retval;
 
-  cmd[1] = ((addr >> 16) & 0xFF);
-  cmd[2] = ((addr >> 8)  & 0xFF);
-  cmd[3] = ((addr >> 0)  & 0xFF);
+  prv->cmd[0] = FLASH_DEEP_POWER_DOWN_RESUME;
 
-  retval = spi_write(prv->spidev, cmd, 4);
+  retval = command_write(prv, 1);
   if(0 != retval)
-  {
-    pr_info("SPI Failed\r\n");
     return retval;
-  }
-
-/* S2 : Write to Buffer 2 */
-  /* Initialize spi_message list */
-  spi_message_init(&m);
 
-  /* Initialize spi_transfer structure with 0 */
-  memset(&t, 0, sizeof(t));
-   
-  cmd[0] = FLASH_BUFFER2_WRITE;
+  usleep_range(FLASH_TRDPD_US, FLASH_TRDPD_US + FLASH_TRDPD_US / 2);
+  return SUCCESS;
+}
 
-  /* Address Offset Fixed to 0 so we write from starting of page */
-  addr = 0x00;
-  cmd[1] = ((addr >> 16) & 0xFF);
-  cmd[2] = ((addr >> 8)  & 0xFF);
-  cmd[3] = ((addr >> 0)  & 0xFF);
+/* Take the bus lock, shared for reads and exclusive for anything that
+   changes the flash, or fail straight away for non blocking requests.
+   The chip is woken from Deep Power-Down first, a failed resume shows 
+   up as errors from the commands that follow. */
+static int flash_lock(struct spi_flash_prv *prv, bool nowait, bool shared)
+{
+  struct device *dev = &prv->spidev->dev;
 
-  /* Safely Copy User Buffer Data to Temporary Buffer */
-  retval = copy_from_user(&cmd[4], buf, size);
-  if(retval != 0)
+  if(!nowait)
   {
-    pr_info("Partial Copy\r\n");
-    return retval;
+    pm_runtime_get_sync(dev);
+    if(shared)
+      down_read(&prv->lock);
+    else
+      down_write(&prv->lock);
   }
+  else
+  {
+    /* Do not sit out tRDPD, start the resume for whoever comes next */
+    pm_runtime_get_noresume(dev);
+    if(!pm_runtime_active(dev))
+    {
+      pm_runtime_put_noidle(dev);
+      pm_request_resume(dev);
+      this_cpu_inc(prv->stats->count[FLASH_STAT_RETRIES]);
+      return -EAGAIN;
+    }
 
-  t.tx_buf = cmd;
-  t.len    = size + 4;
-  spi_message_add_tail(&t, &m);
+    if(!(shared ? down_read_trylock(&prv->lock) : down_write_trylock(&prv->lock)))
+    {
+      pm_runtime_put_autosuspend(dev);
+      this_cpu_inc(prv->stats->count[FLASH_STAT_RETRIES]);
+      return -EAGAIN;
+    }
+  }
 
-  retval = spi_sync(prv->spidev, &m);
-  if(0 != retval)
+  /* Remove has written everything back and let go of the chip, users 
+     still holding prv only get to drop their reference */
+  if(prv->gone)
   {
-    pr_info("SPI Failed\r\n");
-    return retval;
+    if(shared)
+      up_read(&prv->lock);
+    else
+      up_write(&prv->lock);
+    pm_runtime_put_noidle(dev);
+    return -ENODEV;
   }
+  return SUCCESS;
+}
 
-/* S3 : Write to SPI Flash from Buffer 2 */
-  cmd[0] = FLASH_BUFFER2_TO_MAIN_MEMORY_WRITE_WITH_ERASE;	
-
-  addr = prv->current_page << 9; 
-
-  cmd[1] = ((addr >> 16) & 0xFF);
-  cmd[2] = ((addr >> 8)  & 0xFF);
-  cmd[3] = ((addr >> 0)  & 0xFF);
+/* Exclusive bus lock for maintenance that can come back later. Fails 
+   when someone else holds it or the chip is in Deep Power-Down, without
+   waking the chip and without counting as a retry of user I/O. */
+static bool flash_trylock_idle(struct spi_flash_prv *prv)
+{
+  struct device *dev = &prv->spidev->dev;
 
-  /* Four Dummy Bytes are needed so size is 8 */
-  retval = spi_write(prv->spidev, cmd, 8);
-  if(0 != retval)
+  pm_runtime_get_noresume(dev);
+  if(!pm_runtime_active(dev))
   {
-    pr_info("SPI Failed\r\n");
-    return retval;
+    pm_runtime_put_noidle(dev);
+    return false;
   }
-  
-  return SUCCESS;
+  if(!down_write_trylock(&prv->lock))
+  {
+    pm_runtime_put_autosuspend(dev);
+    return false;
+  }
+  if(prv->gone)
+  {
+    up_write(&prv->lock);
+    pm_runtime_put_noidle(dev);
+    return false;
+  }
+  return true;
 }
 
-static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/* Drop the bus lock, the chip powers down once idle for the autosuspend 
+   delay. Bursts keep pushing the deadline out and never see tRDPD. */
+static void flash_unlock(struct spi_flash_prv *prv, bool shared)
 {
-  int err = 0;
-  unsigned int val = 0;
+  struct device *dev = &prv->spidev->dev;
 
-  unsigned int *ptr = (unsigned int *)arg;
+  WRITE_ONCE(prv->last_io, jiffies);
 
-  pr_info("IOCTL Operation Invoked\r\n");
- 
-  /* Check if Magic Number is Matching */
-  if(_IOC_TYPE(cmd) != SPI_MAGIC)
-    return -ENOTTY;
+  if(shared)
+    up_read(&prv->lock);
+  else
+    up_write(&prv->lock);
 
-  /* Check if Command is within Range */
-  if(_IOC_NR(cmd) > MAX_IOCTL)
-    return -ENOTTY;
+  pm_runtime_mark_last_busy(dev);
+  pm_runtime_put_autosuspend(dev);
+}
 
-  /* Check that the user space pointer is accessible */
-  if(_IOC_DIR(cmd) & _IOC_READ)
-    err = !access_ok(VERIFY_WRITE, (void *)arg, _IOC_SIZE(cmd));
+/* Read the Status Register */
+static int read_status(struct spi_flash_prv *prv)
+{
+  int retval;
+
+  prv->cmd[0] = FLASH_STATUS_REGISTER_READ;
+
+  retval = command_read(prv, 1, 1);
+  if(0 != retval)
+    return retval;
+
+  return prv->cmd[FLASH_CMD_RX];
+}
+
+/* Note the start of an internal operation, the device is busy from now */
+static void set_busy(struct spi_flash_prv *prv, enum flash_op op)
+{
+  prv->busy_op    = op;
+  prv->busy_start = ktime_get();
+}
+
+/* Record how long an operation took and update its running average */
+static void account_busy(struct spi_flash_prv *prv, enum flash_op op,
+                         unsigned int elapsed_us)
+{
+  struct flash_op_stats *st = &prv->op_stats[op];
+
+  if(st->count == 0)
+    st->avg_us = elapsed_us;
+  else
+    st->avg_us = (st->avg_us * 7 + elapsed_us) / 8;
+
+  st->count    += 1;
+  st->last_us   = elapsed_us;
+  st->total_us += elapsed_us;
+  if(elapsed_us > st->max_us)
+    st->max_us = elapsed_us;
+}
+
+/*
+   Wait for the operation recorded by set_busy() to complete.
+   The status register is polled back to back for a few microseconds, 
+   which covers buffer transfers. Longer operations then sleep on hrtimers 
+   for most of their expected duration (running average of earlier runs, 
+   datasheet typical time before that) and poll in finer slices afterwards, 
+   so multi-second erases cost a handful of status reads.
+*/
+static int wait_ready(struct spi_flash_prv *prv)
+{
+  int      status;
+  int64_t  elapsed, expected, slice, sleep_us;
+  enum flash_op op = prv->busy_op;
+
+  /* Every command starting an internal operation goes through set_busy() 
+     so nothing pending means the device is idle */
+  if(op == FLASH_OP_NONE)
+    return SUCCESS;
+
+  expected = prv->op_stats[op].count ? prv->op_stats[op].avg_us : 
+                                       op_timing[op].typ_us;
+  slice    = max_t(int64_t, expected / 16, FLASH_READY_SLICE_US);
+
+  for(;;)
+  {
+    status = read_status(prv);
+    if(status < 0)
+      return status;
+
+    elapsed = ktime_us_delta(ktime_get(), prv->busy_start);
+
+    if(status & FLASH_STATUS_READY)
+    {
+      /* Compare result is valid once the device is ready */
+      prv->status = status;
+      break;
+    }
+
+    if(elapsed > 2 * (int64_t)op_timing[op].max_us)
+    {
+      pr_info("Device Ready Timeout on %s\r\n", op_timing[op].name);
+      this_cpu_inc(prv->stats->count[FLASH_STAT_ERRORS]);
+      trace_spi_flash_cmd_complete(prv->name, prv->busy_cmd, prv->busy_page, 0,
+                                   elapsed * NSEC_PER_USEC, -ETIMEDOUT, status);
+      prv->busy_op = FLASH_OP_NONE;
+      return -ETIMEDOUT;
+    }
+
+    if(elapsed < FLASH_READY_SPIN_US)
+      continue;
+
+    /* Sleep through most of the expected time, then in short slices */
+    sleep_us = (expected * 3) / 4 - elapsed;
+    if(sleep_us < slice)
+      sleep_us = slice;
+    usleep_range(sleep_us, sleep_us + sleep_us / 8);
+  }
+
+  account_busy(prv, op, elapsed);
+  stat_busy(prv, op, elapsed);
+  trace_spi_flash_cmd_complete(prv->name, prv->busy_cmd, prv->busy_page, 0,
+                               elapsed * NSEC_PER_USEC, 0, status);
+  prv->busy_op = FLASH_OP_NONE;
+
+  return SUCCESS;
+}
+
+/* Match the page size mode of the chip to the "pagesize" property. The
+   power of two setting is one-time programmable and shows in the status
+   register, so it is only written to a part still in DataFlash mode and
+   the part takes it after a power cycle. Such a part can not go back to
+   DataFlash pages. */
+static int set_page_size(struct spi_flash_prv *prv)
+{
+  int      status;
+  bool     binary;
+  uint8_t *buff = prv->cmd;
+
+  if(prv->page_size == prv->geo->binary_page)
+    binary = true;
+  else if(prv->page_size == prv->geo->dataflash_page)
+    binary = false;
+  else
+  {
+    pr_info("%s Pages are %d or %d Bytes\r\n", prv->geo->name,
+            prv->geo->binary_page, prv->geo->dataflash_page);
+    return -EINVAL;
+  }
+  /* The page number starts right above the byte offset */
+  prv->page_shift = binary ? prv->geo->offset_bits - 1 : prv->geo->offset_bits;
+
+  status = read_status(prv);
+  if(status < 0)
+    return status;
+  if(!binary)
+  {
+    if(status & FLASH_STATUS_PAGE_SIZE)
+    {
+      pr_info("Device is Set to %d Byte Pages\r\n", prv->geo->binary_page);
+      return -EINVAL;
+    }
+    return SUCCESS;
+  }
+  if(status & FLASH_STATUS_PAGE_SIZE)
+    return SUCCESS;
+
+  pr_info("Programming %d Byte Page Size\r\n", prv->page_size);
+
+  buff[0] = FLASH_POWER_OF_TWO_PAGE_SIZE1;
+  buff[1] = FLASH_POWER_OF_TWO_PAGE_SIZE2;
+  buff[2] = FLASH_POWER_OF_TWO_PAGE_SIZE3; 
+  buff[3] = FLASH_POWER_OF_TWO_PAGE_SIZE4;
+ 
+  status = command_start(prv, 4, -1);
+  if(0 != status)
+    return status;
+  set_busy(prv, FLASH_OP_PROGRAM);
+  status = wait_ready(prv);
+  if(0 != status)
+    return status;
+
+  status = read_status(prv);
+  if(status < 0)
+    return status;
+  if(!(status & FLASH_STATUS_PAGE_SIZE))
+  {
+    pr_info("Power Cycle the Device to Use %d Byte Pages\r\n", prv->page_size);
+    return -EAGAIN;
+  }
+  return SUCCESS;
+}
+
+/*
+   Every page of a sector has to be rewritten at least once within 10,000
+   cumulative page program and erase operations in that sector, or the 
+   pages that were left alone may lose data. Count them per sector and 
+   start the rewrite worker once a sector gets close to the limit.
+   Counts start from zero at probe.
+*/
+static void rewrite_note(struct spi_flash_prv *prv, unsigned int page_no, 
+                         unsigned int ops)
+{
+  unsigned int *count = &prv->rewrite_count[page_no / prv->sector_pages];
+
+  *count += ops;
+  if(*count >= FLASH_REWRITE_DUE)
+    queue_delayed_work(system_power_efficient_wq, &prv->rewrite_work, 
+                       msecs_to_jiffies(rewrite_idle_ms));
+}
+
+/* A whole sector was erased, its pages are all fresh */
+static void rewrite_reset(struct spi_flash_prv *prv, unsigned int sector)
+{
+  prv->rewrite_count[sector] = 0;
+  if(prv->rewrite_sector == sector)
+    prv->rewrite_sector = UINT_MAX;
+}
+
+/* Send a command carrying a page address (opcode + 3 address bytes) */
+static int page_command(struct spi_flash_prv *prv, uint8_t opcode,
+                        unsigned int page_no)
+{
+  uint32_t addr;
+  uint8_t *cmd = prv->cmd;
+
+  cmd[0] = opcode;
+  /* Byte offset in the low page_shift bits, page number above it,
+     e.g. 9 + 13 bits for 512 byte pages on a 32Mbit part */
+  addr = page_no << prv->page_shift;
+  cmd[1] = ((addr >> 16) & 0xFF);
+  cmd[2] = ((addr >> 8)  & 0xFF);
+  cmd[3] = ((addr >> 0)  & 0xFF);
+
+  return command_start(prv, 4, page_no);
+}
+
+/* Issue an erase command addressed by its first page and wait for it */
+static int erase_unit(struct spi_flash_prv *prv, uint8_t opcode,
+                      unsigned int page_no, enum flash_op op)
+{
+  int retval;
+
+  retval = page_command(prv, opcode, page_no);
+  if(0 != retval)
+  {
+    pr_info("SPI Failed\r\n");
+    return retval;
+  }
+  set_busy(prv, op);
+
+  retval = wait_ready(prv);
+  if(0 != retval)
+    return retval;
+
+  /* Sector 0 is erased in two halves and only ever swept */
+  if(op == FLASH_OP_PAGE_ERASE)
+    rewrite_note(prv, page_no, 1);
+  else if(op == FLASH_OP_BLOCK_ERASE)
+    rewrite_note(prv, page_no, FLASH_BLOCK_PAGES);
+  else if(op == FLASH_OP_SECTOR_ERASE && page_no >= prv->sector_pages)
+    rewrite_reset(prv, page_no / prv->sector_pages);
+
+  return SUCCESS;
+}
+
+/* Single Page Erase */
+static int erase_page(struct spi_flash_prv *prv, unsigned int page_no)
+{
+  return erase_unit(prv, FLASH_PAGE_ERASE, page_no, FLASH_OP_PAGE_ERASE);
+}
+
+/* First page and length of the sector holding page_no. Sector 0 is split
+   into Sector 0a (the first block) and Sector 0b (rest of the sector) */
+static unsigned int sector_span(struct spi_flash_prv *prv, unsigned int page_no,
+                                unsigned int *first)
+{
+  if(page_no < FLASH_BLOCK_PAGES)
+  {
+    *first = 0;
+    return FLASH_BLOCK_PAGES;
+  }
+  if(page_no < prv->sector_pages)
+  {
+    *first = FLASH_BLOCK_PAGES;
+    return prv->sector_pages - FLASH_BLOCK_PAGES;
+  }
+  *first = page_no - (page_no % prv->sector_pages);
+  return prv->sector_pages;
+}
+
+/*
+   Erase count pages starting at page_no with the fewest commands.
+   Whole sectors go with Sector Erase, whole 8 page blocks with Block Erase
+   and only the ragged ends with Page Erase, waiting for ready in between.
+*/
+static int erase_range(struct spi_flash_prv *prv, unsigned int page_no,
+                       unsigned int count)
+{
+  int          retval = 0;
+  unsigned int first, span;
+
+  while(count && 0 == retval)
+  {
+    span = sector_span(prv, page_no, &first);
+
+    if(page_no == first && count >= span)
+    {
+      retval = erase_unit(prv, FLASH_SECTOR_ERASE, page_no, FLASH_OP_SECTOR_ERASE);
+    }
+    else if((page_no % FLASH_BLOCK_PAGES) == 0 && count >= FLASH_BLOCK_PAGES)
+    {
+      span   = FLASH_BLOCK_PAGES;
+      retval = erase_unit(prv, FLASH_BLOCK_ERASE, page_no, FLASH_OP_BLOCK_ERASE);
+    }
+    else
+    {
+      span   = 1;
+      retval = erase_page(prv, page_no);
+    }
+    page_no += span;
+    count   -= span;
+  }
+  return retval;
+}
+
+/* Sector Erase, Sector 0 covers both Sector 0a and Sector 0b */
+static int erase_sector(struct spi_flash_prv *prv, unsigned int sector_no)
+{
+  return erase_range(prv, sector_no * prv->sector_pages, prv->sector_pages);
+}
+
+/* Full Chip Erase */
+static int erase_chip(struct spi_flash_prv *prv)
+{
+  uint32_t     retval;
+  unsigned int sector;
+  uint8_t     *cmd = prv->cmd;
+
+  cmd[0] = FLASH_BULK_ERASE1;
+  cmd[1] = FLASH_BULK_ERASE2;
+  cmd[2] = FLASH_BULK_ERASE3;
+  cmd[3] = FLASH_BULK_ERASE4;
+
+  retval = command_start(prv, 4, -1);
+  if(0 != retval)
+  {
+    pr_info("SPI Failed\r\n");
+    return retval;
+  }
+  set_busy(prv, FLASH_OP_CHIP_ERASE);
+
+  /* Sleeps for most of the erase time instead of spinning on the bus */
+  retval = wait_ready(prv);
+  if(0 != retval)
+    return retval;
+
+  for(sector = 0; sector < prv->max_pages / prv->sector_pages; sector++)
+    rewrite_reset(prv, sector);
+
+  return SUCCESS;
+}
+
+/* Continuous Array Read command for a linear flash address, returns
+   the command length. Transfers carrying it run at prv->read_hz. */
+static unsigned int read_command(struct spi_flash_prv *prv, uint8_t *cmd,
+                                 uint32_t pos)
+{
+  uint32_t addr;
+
+  cmd[0] = prv->read_opcode;
+
+  /* The byte address is (page << page_shift) | offset, which is not the
+     linear position with DataFlash pages. The device keeps clocking out 
+     data across page boundaries until CS is released, so any range can
+     be streamed with one command */
+  addr = ((pos / prv->page_size) << prv->page_shift) | (pos % prv->page_size);
+  cmd[1] = ((addr >> 16) & 0xFF);
+  cmd[2] = ((addr >> 8)  & 0xFF);
+  cmd[3] = ((addr >> 0)  & 0xFF);
+  /* One dummy byte is needed after the address for the high frequency read */
+  cmd[4] = DUMMY;
+
+  return prv->read_cmd_len;
+}
+
+/* Continuous Array Read of len bytes starting at a linear flash address.
+   buf must be DMA-safe, a transfer buffer or a cache page. Readers run
+   concurrently, so each brings its own command buffer. */
+static int read_array(struct spi_flash_prv *prv, uint8_t *cmd, uint32_t addr,
+                      uint8_t *buf, size_t len)
+{
+  struct spi_transfer t[2];
+  struct spi_message  m;
+
+  spi_message_init(&m);
+  memset(t, 0, sizeof(t));
+
+  t[0].tx_buf   = cmd;
+  t[0].len      = read_command(prv, cmd, addr);
+  t[0].speed_hz = prv->read_hz;
+  spi_message_add_tail(&t[0], &m);
+
+  t[1].rx_buf   = buf;
+  t[1].len      = len;
+  t[1].speed_hz = prv->read_hz;
+  spi_message_add_tail(&t[1], &m);
+
+  return flash_sync(prv, &m, cmd[0], addr / prv->page_size, len, 
+                    FLASH_LAT_READ);
+}
+
+/* Internal SRAM buffer opcodes, indexed by buffer number (0 = Buffer 1) */
+static const uint8_t buffer_write_op[2] = {
+  FLASH_BUFFER1_WRITE,
+  FLASH_BUFFER2_WRITE,
+};
+static const uint8_t buffer_program_op[2] = {
+  FLASH_BUFFER1_TO_MAIN_MEMORY_WRITE_WITH_ERASE,
+  FLASH_BUFFER2_TO_MAIN_MEMORY_WRITE_WITH_ERASE,
+};
+static const uint8_t buffer_program_noerase_op[2] = {
+  FLASH_BUFFER1_TO_MAIN_MEMORY_WRITE_WITHOUT_ERASE,
+  FLASH_BUFFER2_TO_MAIN_MEMORY_WRITE_WITHOUT_ERASE,
+};
+static const uint8_t buffer_load_op[2] = {
+  FLASH_TRANSFER_MAIN_MEMORY_PAGE_TO_BUFFER1,
+  FLASH_TRANSFER_MAIN_MEMORY_PAGE_TO_BUFFER2,
+};
+static const uint8_t buffer_compare_op[2] = {
+  FLASH_COMPARE_MAIN_MEMORY_PAGE_WITH_BUFFER1,
+  FLASH_COMPARE_MAIN_MEMORY_PAGE_WITH_BUFFER2,
+};
+static const uint8_t buffer_rewrite_op[2] = {
+  FLASH_AUTO_PAGE_REWRITE_BUFFER1,
+  FLASH_AUTO_PAGE_REWRITE_BUFERF2,
+};
+
+/* Write len bytes into SRAM buffer bufno starting at byte offset */
+static int write_buffer(struct spi_flash_prv *prv, unsigned int bufno,
+                        unsigned int offset, const uint8_t *data, size_t len)
+{
+  uint8_t *cmd = prv->cmd;
+
+  struct spi_transfer t[2];
+  struct spi_message  m;
+
+  cmd[0] = buffer_write_op[bufno];
+  cmd[1] = ((offset >> 16) & 0xFF);
+  cmd[2] = ((offset >> 8)  & 0xFF);
+  cmd[3] = ((offset >> 0)  & 0xFF);
+
+  spi_message_init(&m);
+  memset(t, 0, sizeof(t));
+
+  t[0].tx_buf = cmd;
+  t[0].len    = 4;
+  spi_message_add_tail(&t[0], &m);
+
+  t[1].tx_buf = data;
+  t[1].len    = len;
+  spi_message_add_tail(&t[1], &m);
+
+  return flash_sync(prv, &m, cmd[0], -1, len, FLASH_LAT_BUFFER);
+}
+
+/*
+   Multi page program alternating between Buffer 1 and Buffer 2.
+   A buffer write is allowed while the device is busy programming the
+   other buffer into main memory, so page N+1 is shifted in over SPI
+   while page N is being programmed and only the program step waits.
+   The buffer in turn is kept in prv so consecutive calls stay pipelined,
+   the caller waits for the last program with wait_ready().
+*/
+static int program_pages(struct spi_flash_prv *prv,
+                         const struct flash_prog *list, unsigned int count)
+{
+  int          retval;
+  unsigned int ii, bufno;
+
+  for(ii = 0; ii < count; ii++)
+  {
+    bufno = prv->next_buffer;
+
+    /* A partial page keeps the bytes around the new ones, so preload the 
+       buffer from main memory. The transfer needs the array so wait for 
+       the last program */
+    if(list[ii].offset || list[ii].len < prv->page_size)
+    {
+      retval = wait_ready(prv);
+      if(0 != retval)
+        return retval;
+      retval = page_command(prv, buffer_load_op[bufno], list[ii].page);
+      if(0 != retval)
+        return retval;
+      set_busy(prv, FLASH_OP_TRANSFER);
+      retval = wait_ready(prv);
+      if(0 != retval)
+        return retval;
+    }
+
+    /* Only the changed bytes go over the bus */
+    retval = write_buffer(prv, bufno, list[ii].offset, list[ii].data, list[ii].len);
+    if(0 != retval)
+      return retval;
+
+    /* Previous page must be programmed before the next program command */
+    retval = wait_ready(prv);
+    if(0 != retval)
+      return retval;
+
+    /* Compare the buffer with main memory, COMP clear means identical so
+       the erase and program cycle can be skipped */
+    if(prv->write_mode == WRITE_MODE_COMPARE && !list[ii].erased)
+    {
+      retval = page_command(prv, buffer_compare_op[bufno], list[ii].page);
+      if(0 != retval)
+        return retval;
+      set_busy(prv, FLASH_OP_TRANSFER);
+      retval = wait_ready(prv);
+      if(0 != retval)
+        return retval;
+      /* Buffer stays free for the next page */
+      if(!(prv->status & FLASH_STATUS_COMP))
+        continue;
+    }
+
+    retval = page_command(prv, list[ii].erased ? buffer_program_noerase_op[bufno] :
+                                                 buffer_program_op[bufno], 
+                          list[ii].page);
+    if(0 != retval)
+      return retval;
+    set_busy(prv, FLASH_OP_PROGRAM);
+    rewrite_note(prv, list[ii].page, 1);
+
+    prv->next_buffer ^= 1;
+  }
+  return SUCCESS;
+}
+
+/* Program len bytes starting at byte address pos, straight to flash.
+   Only the first and last page can be partial, each costs one extra 
+   main memory to buffer transfer. */
+static int program_range(struct spi_flash_prv *prv, loff_t pos,
+                         const uint8_t *data, size_t len)
+{
+  int          retval = 0;
+  unsigned int count, offset;
+  size_t       chunk;
+  struct flash_prog list[FLASH_PROG_BATCH];
+
+  while(len && 0 == retval)
+  {
+    for(count = 0; count < FLASH_PROG_BATCH && len; count++)
+    {
+      offset = pos % prv->page_size;
+      chunk  = min_t(size_t, len, prv->page_size - offset);
+
+      list[count].page   = pos / prv->page_size;
+      list[count].offset = offset;
+      list[count].data   = data;
+      list[count].len    = chunk;
+      list[count].erased = false;
+
+      pos  += chunk;
+      data += chunk;
+      len  -= chunk;
+    }
+    retval = program_pages(prv, list, count);
+  }
+
+  /* Last page has to be in main memory before returning, this also 
+     covers a program left running when the loop stopped early */
+  if(0 != wait_ready(prv) && 0 == retval)
+    retval = -ETIMEDOUT;
+
+  return retval;
+}
+
+/* Sector most in need of a rewrite sweep, UINT_MAX if none is due */
+static unsigned int rewrite_pick(struct spi_flash_prv *prv, unsigned int due)
+{
+  unsigned int sector, best = UINT_MAX;
+
+  for(sector = 0; sector < prv->max_pages / prv->sector_pages; sector++)
+  {
+    if(prv->rewrite_count[sector] >= due &&
+       (best == UINT_MAX || prv->rewrite_count[sector] > prv->rewrite_count[best]))
+      best = sector;
+  }
+  return best;
+}
+
+/*
+   Sweep due sectors with Auto Page Rewrite, which reads a page into a 
+   buffer and programs it back in place. Runs only once foreground I/O 
+   has been quiet for rewrite_idle_ms, never waits for the bus lock and 
+   lets go of it as soon as someone else wants it, so a foreground request
+   is held up by one page rewrite at most. A sector close to the limit is
+   swept even under constant load.
+*/
+static void rewrite_work(struct work_struct *work)
+{
+  struct spi_flash_prv *prv = container_of(to_delayed_work(work), 
+                                           struct spi_flash_prv, rewrite_work);
+  struct device *dev = &prv->spidev->dev;
+  unsigned long  idle = msecs_to_jiffies(rewrite_idle_ms);
+  unsigned long  quiet = READ_ONCE(prv->last_io) + idle;
+  unsigned int   ii, last, bufno;
+  bool           urgent, more;
+
+  urgent = (UINT_MAX != rewrite_pick(prv, FLASH_REWRITE_URGENT));
+  if(!urgent && time_before(jiffies, quiet))
+  {
+    queue_delayed_work(system_power_efficient_wq, &prv->rewrite_work, 
+                       quiet - jiffies);
+    return;
+  }
+  /* Only a sector close to the limit waits for the bus or wakes the chip */
+  if(urgent ? 0 != flash_lock(prv, false, false) : !flash_trylock_idle(prv))
+  {
+    if(!prv->gone)
+      queue_delayed_work(system_power_efficient_wq, &prv->rewrite_work, idle);
+    return;
+  }
+
+  if(prv->rewrite_sector == UINT_MAX)
+  {
+    prv->rewrite_sector = rewrite_pick(prv, FLASH_REWRITE_DUE);
+    prv->rewrite_page   = prv->rewrite_sector * prv->sector_pages;
+    if(prv->rewrite_sector != UINT_MAX)
+      prv->rewrite_base = prv->rewrite_count[prv->rewrite_sector];
+  }
+
+  if(prv->rewrite_sector != UINT_MAX)
+  {
+    last = (prv->rewrite_sector + 1) * prv->sector_pages;
+    for(ii = 0; ii < FLASH_REWRITE_BATCH && prv->rewrite_page < last; ii++)
+    {
+      if(ii > 0 && rwsem_is_contended(&prv->lock))
+        break;
+
+      bufno = prv->next_buffer;
+      if(0 != page_command(prv, buffer_rewrite_op[bufno], prv->rewrite_page))
+        break;
+      set_busy(prv, FLASH_OP_REWRITE);
+      if(0 != wait_ready(prv))
+        break;
+      prv->next_buffer ^= 1;
+      prv->rewrite_page++;
+    }
+
+    /* Programs that landed during the sweep count towards the next one */
+    if(prv->rewrite_page == last)
+    {
+      prv->rewrite_count[prv->rewrite_sector] -= prv->rewrite_base;
+      prv->rewrite_sector = UINT_MAX;
+    }
+  }
+  more = (prv->rewrite_sector != UINT_MAX) || 
+         (UINT_MAX != rewrite_pick(prv, FLASH_REWRITE_DUE));
+
+  /* Released by hand, maintenance does not count as foreground I/O */
+  up_write(&prv->lock);
+  pm_runtime_mark_last_busy(dev);
+  pm_runtime_put_autosuspend(dev);
+
+  if(more)
+    queue_delayed_work(system_power_efficient_wq, &prv->rewrite_work, 0);
+}
+
+/*
+   Flash Translation Layer, enabled with ftl=1.
+   Users see logical pages of FTL_PAYLOAD bytes. Each one lives in some 
+   physical page behind a header naming the logical page, a sequence 
+   number and a CRC. Writes never go back to the page they replace: the 
+   new copy is programmed into the next erased page of a circular log 
+   running over the whole chip, using Program without Erase, and the old 
+   copy goes stale. Wear is spread over every page and the erase happens 
+   later in the garbage collector, off the write path. The map is kept in 
+   RAM and rebuilt at probe from the headers, the newest copy wins.
+*/
+#define FTL_MAGIC        0x4C544641 /* "AFTL" */
+#define FTL_PAYLOAD(prv) ((prv)->page_size - sizeof(struct ftl_header))
+#define FTL_UNMAPPED     UINT_MAX
+/* One physical page in this many is kept back so the log never runs dry */
+#define FTL_RESERVE_DIV  16
+/* Pages erased per garbage collection pass before the lock is dropped */
+#define FTL_GC_BATCH     16
+
+struct ftl_header
+{
+  __le32 magic;
+  __le32 lpage;
+  __le32 seq;
+  __le32 crc;   /* Over lpage, seq and the payload */
+};
+
+enum ftl_page_state
+{
+  FTL_PAGE_ERASED = 0,
+  FTL_PAGE_VALID,
+  FTL_PAGE_STALE,
+};
+
+static uint32_t ftl_crc(struct spi_flash_prv *prv, const uint8_t *page)
+{
+  const struct ftl_header *hdr = (const struct ftl_header *)page;
+  uint32_t crc;
+
+  crc = crc32_le(~0, (const uint8_t *)&hdr->lpage, 2 * sizeof(__le32));
+  return crc32_le(crc, page + sizeof(*hdr), FTL_PAYLOAD(prv));
+}
+
+static void ftl_set_state(struct spi_flash_prv *prv, unsigned int phys, 
+                          enum ftl_page_state state)
+{
+  if(prv->ftl_state[phys] == FTL_PAGE_ERASED)
+    prv->ftl_free--;
+  else if(prv->ftl_state[phys] == FTL_PAGE_STALE)
+    prv->ftl_stale--;
+
+  if(state == FTL_PAGE_ERASED)
+    prv->ftl_free++;
+  else if(state == FTL_PAGE_STALE)
+    prv->ftl_stale++;
+
+  prv->ftl_state[phys] = state;
+}
+
+/* Sort one physical page found at probe into erased, valid or stale */
+static void ftl_classify(struct spi_flash_prv *prv, unsigned int phys, 
+                         const uint8_t *page, uint32_t *seqs)
+{
+  const struct ftl_header *hdr = (const struct ftl_header *)page;
+  unsigned int lpage, old;
+
+  if(NULL == memchr_inv(page, 0xFF, prv->page_size))
+  {
+    ftl_set_state(prv, phys, FTL_PAGE_ERASED);
+    return;
+  }
+
+  /* Anything without a good header, including a program cut short by a
+     power loss, has to be erased before it can be used again */
+  lpage = le32_to_cpu(hdr->lpage);
+  if(le32_to_cpu(hdr->magic) != FTL_MAGIC || lpage >= prv->ftl_pages ||
+     le32_to_cpu(hdr->crc) != ftl_crc(prv, page))
+  {
+    ftl_set_state(prv, phys, FTL_PAGE_STALE);
+    return;
+  }
+
+  seqs[phys] = le32_to_cpu(hdr->seq);
+  if((int32_t)(seqs[phys] - prv->ftl_seq) > 0)
+  {
+    prv->ftl_seq  = seqs[phys];
+    prv->ftl_next = (phys + 1) % prv->max_pages;
+  }
+
+  old = prv->ftl_map[lpage];
+  if(old != FTL_UNMAPPED && (int32_t)(seqs[old] - seqs[phys]) > 0)
+  {
+    ftl_set_state(prv, phys, FTL_PAGE_STALE);
+    return;
+  }
+  if(old != FTL_UNMAPPED)
+    ftl_set_state(prv, old, FTL_PAGE_STALE);
+
+  prv->ftl_map[lpage] = phys;
+  ftl_set_state(prv, phys, FTL_PAGE_VALID);
+}
+
+/* Rebuild the map by streaming the whole chip once, at probe */
+static int ftl_scan(struct spi_flash_prv *prv)
+{
+  int          retval = 0;
+  unsigned int base, count, ii, per_chunk;
+  uint32_t    *seqs;
+  uint8_t     *buf;
+
+  per_chunk = FLASH_READ_CHUNK / prv->page_size;
+  seqs = kcalloc(prv->max_pages, sizeof(*seqs), GFP_KERNEL);
+  buf  = kmalloc(FLASH_READ_CHUNK, GFP_KERNEL);
+  if(seqs == NULL || buf == NULL)
+  {
+    retval = -ENOMEM;
+    goto out;
+  }
+
+  for(base = 0; base < prv->max_pages && 0 == retval; base += count)
+  {
+    count  = min(per_chunk, prv->max_pages - base);
+    retval = read_array(prv, prv->cmd, base * prv->page_size, buf, 
+                        count * prv->page_size);
+    for(ii = 0; ii < count && 0 == retval; ii++)
+      ftl_classify(prv, base + ii, buf + ii * prv->page_size, seqs);
+  }
+
+out:
+  kfree(buf);
+  kfree(seqs);
+  return retval;
+}
+
+/* Next erased page from the head of the log */
+static int ftl_alloc(struct spi_flash_prv *prv)
+{
+  unsigned int ii, phys;
+
+  for(ii = 0; ii < prv->max_pages && prv->ftl_free; ii++)
+  {
+    phys = (prv->ftl_next + ii) % prv->max_pages;
+    if(prv->ftl_state[phys] == FTL_PAGE_ERASED)
+    {
+      prv->ftl_next = (phys + 1) % prv->max_pages;
+      return phys;
+    }
+  }
+  return -ENOSPC;
+}
+
+/* Erase up to limit stale pages, lock held exclusively. A block whose 
+   8 pages are all stale goes with one Block Erase. Returns the number 
+   of stale pages left. */
+static int ftl_collect(struct spi_flash_prv *prv, unsigned int limit)
+{
+  int          retval;
+  unsigned int block, ii, stale, done = 0;
+
+  /* Called between pipelined programs, the last one has to finish first */
+  retval = wait_ready(prv);
+  if(0 != retval)
+    return retval;
+
+  for(block = 0; block < prv->max_pages && prv->ftl_stale && done < limit;
+      block += FLASH_BLOCK_PAGES)
+  {
+    for(ii = 0, stale = 0; ii < FLASH_BLOCK_PAGES; ii++)
+      stale += (prv->ftl_state[block + ii] == FTL_PAGE_STALE);
+    if(stale == 0)
+      continue;
+
+    if(stale == FLASH_BLOCK_PAGES)
+    {
+      retval = erase_unit(prv, FLASH_BLOCK_ERASE, block, FLASH_OP_BLOCK_ERASE);
+      if(0 != retval)
+        return retval;
+      for(ii = 0; ii < FLASH_BLOCK_PAGES; ii++)
+        ftl_set_state(prv, block + ii, FTL_PAGE_ERASED);
+      done += FLASH_BLOCK_PAGES;
+      continue;
+    }
+
+    for(ii = 0; ii < FLASH_BLOCK_PAGES; ii++)
+    {
+      if(prv->ftl_state[block + ii] != FTL_PAGE_STALE)
+        continue;
+      retval = erase_page(prv, block + ii);
+      if(0 != retval)
+        return retval;
+      ftl_set_state(prv, block + ii, FTL_PAGE_ERASED);
+      done++;
+    }
+  }
+  return prv->ftl_stale;
+}
+
+static void ftl_gc_work(struct work_struct *work)
+{
+  int                   retval;
+  struct spi_flash_prv *prv = container_of(to_delayed_work(work), 
+                                           struct spi_flash_prv, ftl_gc_work);
+
+  if(0 != flash_lock(prv, false, false))
+    return;
+  retval = ftl_collect(prv, FTL_GC_BATCH);
+  flash_unlock(prv, false);
+
+  /* Come back for the rest, readers and writers get the lock in between */
+  if(retval > 0)
+    schedule_delayed_work(&prv->ftl_gc_work, 0);
+}
+
+/* Read len bytes at logical address pos, lock held. Unwritten logical 
+   pages read as erased. */
+static int ftl_read(struct spi_flash_prv *prv, struct flash_xfer *xfer, 
+                    loff_t pos, uint8_t *buf, size_t len)
+{
+  int          retval;
+  unsigned int lpage, offset, phys;
+  size_t       chunk;
+
+  for(; len; pos += chunk, buf += chunk, len -= chunk)
+  {
+    lpage  = div_u64_rem(pos, FTL_PAYLOAD(prv), &offset);
+    chunk  = min_t(size_t, len, FTL_PAYLOAD(prv) - offset);
+    phys   = prv->ftl_map[lpage];
+
+    if(phys == FTL_UNMAPPED)
+    {
+      memset(buf, 0xFF, chunk);
+      continue;
+    }
+    retval = read_array(prv, xfer ? xfer->cmd : prv->cmd, 
+                        phys * prv->page_size + sizeof(struct ftl_header) + offset,
+                        buf, chunk);
+    if(0 != retval)
+      return retval;
+  }
+  return SUCCESS;
+}
+
+/* Write one logical page or part of it into a fresh physical page */
+static int ftl_write_page(struct spi_flash_prv *prv, unsigned int lpage, 
+                          unsigned int offset, const uint8_t *data, size_t len)
+{
+  int                retval;
+  unsigned int       old = prv->ftl_map[lpage];
+  uint8_t           *payload = prv->ftl_buf + sizeof(struct ftl_header);
+  struct ftl_header *hdr = (struct ftl_header *)prv->ftl_buf;
+  struct flash_prog  prog;
+
+  /* The rest of a partial page comes from its current copy. Its program
+     may still be running, the array is only readable once it is done.
+     The whole page is read so the DMA target starts on the cache line
+     aligned buffer, the old header is overwritten below. */
+  if(len < FTL_PAYLOAD(prv))
+  {
+    if(old == FTL_UNMAPPED)
+      memset(payload, 0xFF, FTL_PAYLOAD(prv));
+    else
+    {
+      retval = wait_ready(prv);
+      if(0 == retval)
+        retval = read_array(prv, prv->cmd, old * prv->page_size,
+                            prv->ftl_buf, prv->page_size);
+      if(0 != retval)
+        return retval;
+    }
+  }
+  memcpy(payload + offset, data, len);
+
+  /* Reclaim stale pages on the spot only when the log has run dry */
+  retval = ftl_alloc(prv);
+  if(retval < 0)
+  {
+    retval = ftl_collect(prv, FLASH_BLOCK_PAGES);
+    if(retval >= 0)
+      retval = ftl_alloc(prv);
+    if(retval < 0)
+      return retval;
+  }
+
+  hdr->magic = cpu_to_le32(FTL_MAGIC);
+  hdr->lpage = cpu_to_le32(lpage);
+  hdr->seq   = cpu_to_le32(++prv->ftl_seq);
+  hdr->crc   = cpu_to_le32(ftl_crc(prv, prv->ftl_buf));
+
+  prog.page   = retval;
+  prog.offset = 0;
+  prog.data   = prv->ftl_buf;
+  prog.len    = prv->page_size;
+  prog.erased = true;
+
+  /* Once shifted into the SRAM buffer the image may be reused, the 
+     program itself overlaps with the next page */
+  retval = program_pages(prv, &prog, 1);
+  if(0 != retval)
+    return retval;
+
+  ftl_set_state(prv, prog.page, FTL_PAGE_VALID);
+  prv->ftl_map[lpage] = prog.page;
+  if(old != FTL_UNMAPPED)
+    ftl_set_state(prv, old, FTL_PAGE_STALE);
+
+  return SUCCESS;
+}
+
+/* Write len bytes at logical address pos, lock held exclusively */
+static int ftl_write(struct spi_flash_prv *prv, loff_t pos, 
+                     const uint8_t *data, size_t len)
+{
+  int          retval = 0;
+  unsigned int lpage, offset;
+  size_t       chunk;
+
+  for(; len && 0 == retval; pos += chunk, data += chunk, len -= chunk)
+  {
+    lpage  = div_u64_rem(pos, FTL_PAYLOAD(prv), &offset);
+    chunk  = min_t(size_t, len, FTL_PAYLOAD(prv) - offset);
+    retval = ftl_write_page(prv, lpage, offset, data, chunk);
+  }
+
+  if(0 != wait_ready(prv) && 0 == retval)
+    retval = -ETIMEDOUT;
+
+  /* Erase the replaced copies once the writer has gone quiet */
+  if(prv->ftl_stale)
+    schedule_delayed_work(&prv->ftl_gc_work, msecs_to_jiffies(flush_ms));
+
+  return retval;
+}
+
+/* Set up the map at probe. The logical space leaves enough physical 
+   pages spare for the log to always find erased ones. */
+static int ftl_init(struct spi_flash_prv *prv)
+{
+  int            retval;
+  unsigned int   ii;
+
+  /* Freed with prv in spi_flash_free() */
+  prv->ftl_pages = prv->max_pages - prv->max_pages / FTL_RESERVE_DIV;
+  prv->ftl_map   = kcalloc(prv->ftl_pages, sizeof(*prv->ftl_map), GFP_KERNEL);
+  prv->ftl_state = kzalloc(prv->max_pages, GFP_KERNEL);
+  /* SPI data buffer, plain kmalloc keeps it cache line aligned */
+  prv->ftl_buf   = kmalloc(prv->page_size, GFP_KERNEL);
+  if(prv->ftl_map == NULL || prv->ftl_state == NULL || prv->ftl_buf == NULL)
+    return -ENOMEM;
+
+  for(ii = 0; ii < prv->ftl_pages; ii++)
+    prv->ftl_map[ii] = FTL_UNMAPPED;
+
+  /* Every page starts out counted as erased, ftl_classify() moves it */
+  prv->ftl_free = prv->max_pages;
+  INIT_DELAYED_WORK(&prv->ftl_gc_work, ftl_gc_work);
+
+  retval = ftl_scan(prv);
+  if(0 != retval)
+    return retval;
+
+  pr_info("FTL %u Logical Pages, %u Erased, %u Stale\r\n", 
+          prv->ftl_pages, prv->ftl_free, prv->ftl_stale);
+
+  prv->size = (loff_t)prv->ftl_pages * FTL_PAYLOAD(prv);
+  if(prv->ftl_stale)
+    schedule_delayed_work(&prv->ftl_gc_work, 0);
+
+  return SUCCESS;
+}
+
+/* Look up a page in the cache, NULL if it is not cached */
+static struct flash_cache_page *cache_find(struct spi_flash_prv *prv,
+                                           unsigned int page)
+{
+  struct flash_cache_page *cp;
+
+  hash_for_each_possible(prv->cache_hash, cp, hash, page)
+  {
+    if(cp->page == page)
+      return cp;
+  }
+  return NULL;
+}
+
+static void cache_free(struct spi_flash_prv *prv, struct flash_cache_page *cp)
+{
+  if(cp->dirty)
+    prv->cache_dirty--;
+
+  hash_del(&cp->hash);
+  list_del(&cp->lru);
+  prv->cache_count--;
+  kfree(cp);
+}
+
+static int cache_cmp_page(const void *a, const void *b)
+{
+  const struct flash_cache_page *pa = *(struct flash_cache_page * const *)a;
+  const struct flash_cache_page *pb = *(struct flash_cache_page * const *)b;
+
+  if(pa->page < pb->page)
+    return -1;
+  return (pa->page > pb->page);
+}
+
+/* Program every dirty page in ascending page order */
+static int cache_flush(struct spi_flash_prv *prv)
+{
+  int          retval = 0;
+  unsigned int ii, jj, batch, count = 0;
+  struct flash_cache_page **dirty, *cp;
+  struct flash_prog list[FLASH_PROG_BATCH];
+
+  if(prv->cache_dirty == 0)
+    return SUCCESS;
+
+  dirty = kmalloc_array(prv->cache_dirty, sizeof(*dirty), GFP_KERNEL);
+  if(dirty == NULL)
+    return -ENOMEM;
+
+  list_for_each_entry(cp, &prv->cache_lru, lru)
+  {
+    if(cp->dirty)
+      dirty[count++] = cp;
+  }
+  sort(dirty, count, sizeof(*dirty), cache_cmp_page, NULL);
+
+  for(ii = 0; ii < count; ii += batch)
+  {
+    batch = min_t(unsigned int, count - ii, FLASH_PROG_BATCH);
+    for(jj = 0; jj < batch; jj++)
+    {
+      /* Only the bytes written since the last flush go over the bus */
+      cp = dirty[ii + jj];
+      list[jj].page   = cp->page;
+      list[jj].offset = cp->dirty_start;
+      list[jj].data   = cp->data + cp->dirty_start;
+      list[jj].len    = cp->dirty_end - cp->dirty_start;
+      list[jj].erased = false;
+    }
+    retval = program_pages(prv, list, batch);
+    if(0 != retval)
+      break;
+
+    /* Programmed pages are clean again, data is kept for later reads */
+    for(jj = 0; jj < batch; jj++)
+    {
+      dirty[ii + jj]->dirty = false;
+      prv->cache_dirty--;
+    }
+  }
+  kfree(dirty);
+
+  if(0 != wait_ready(prv) && 0 == retval)
+    retval = -ETIMEDOUT;
+
+  if(0 != retval)
+    pr_info("Cache Flush Failed\r\n");
+
+  return retval;
+}
+
+/* Get a free cache entry, evicting the least recently used page when the 
+   budget is used up. A dirty victim is written back first, which only an
+   exclusive holder of the bus lock may do, shared holders go without.
+   The entry counts against the budget but is not in the cache yet, 
+   cache_insert() adds it once its data is valid. */
+static struct flash_cache_page *cache_reserve(struct spi_flash_prv *prv,
+                                              bool shared)
+{
+  struct flash_cache_page *cp;
+  struct flash_prog prog;
+
+  if(prv->cache_max == 0)
+    return NULL;
+
+  if(prv->cache_count >= prv->cache_max)
+  {
+    /* Everything may be reserved by read-ahead in flight */
+    if(list_empty(&prv->cache_lru))
+      return NULL;
+    cp = list_last_entry(&prv->cache_lru, struct flash_cache_page, lru);
+    if(cp->dirty)
+    {
+      if(shared)
+        return NULL;
+      prog.page   = cp->page;
+      prog.offset = cp->dirty_start;
+      prog.data   = cp->data + cp->dirty_start;
+      prog.len    = cp->dirty_end - cp->dirty_start;
+      prog.erased = false;
+      if(0 != program_pages(prv, &prog, 1) || 0 != wait_ready(prv))
+        return NULL;
+    }
+    cache_free(prv, cp);
+  }
+
+  cp = kmalloc(sizeof(*cp) + prv->page_size, GFP_KERNEL);
+  if(cp == NULL)
+    return NULL;
+
+  cp->dirty = false;
+  prv->cache_count++;
+
+  return cp;
+}
+
+static void cache_insert(struct spi_flash_prv *prv, struct flash_cache_page *cp,
+                         unsigned int page)
+{
+  cp->page = page;
+  hash_add(prv->cache_hash, &cp->hash, page);
+  list_add(&cp->lru, &prv->cache_lru);
+}
+
+/* Give back a reserved entry that never made it into the cache */
+static void cache_unreserve(struct spi_flash_prv *prv, struct flash_cache_page *cp)
+{
+  prv->cache_count--;
+  kfree(cp);
+}
+
+static struct flash_cache_page *cache_alloc(struct spi_flash_prv *prv,
+                                            unsigned int page, bool shared)
+{
+  struct flash_cache_page *cp;
+
+  cp = cache_reserve(prv, shared);
+  if(cp != NULL)
+    cache_insert(prv, cp, page);
+  return cp;
+}
+
+/* Bring a whole page into the cache from flash. xfer is the caller's
+   transfer buffer set when it holds the bus lock shared, NULL when it 
+   holds it exclusively and may use prv->cmd. Cache lock held, it is 
+   dropped during the transfer like in cache_readahead(), and the page 
+   goes in unless another reader was quicker. */
+static struct flash_cache_page *cache_fill(struct spi_flash_prv *prv,
+                                           struct flash_xfer *xfer,
+                                           unsigned int page)
+{
+  int                      retval;
+  struct flash_cache_page *cp;
+
+  cp = cache_reserve(prv, xfer != NULL);
+  if(cp == NULL)
+    return NULL;
+
+  mutex_unlock(&prv->cache_lock);
+  retval = read_array(prv, xfer ? xfer->cmd : prv->cmd, page * prv->page_size, 
+                      cp->data, prv->page_size);
+  mutex_lock(&prv->cache_lock);
+
+  if(0 != retval || NULL != cache_find(prv, page))
+  {
+    cache_unreserve(prv, cp);
+    return retval ? NULL : cache_find(prv, page);
+  }
+  cache_insert(prv, cp, page);
+
+  return cp;
+}
+
+/* Like cache_fill(), but a reader that misses right where its previous
+   miss ended is taken as sequential and also gets the pages after it in 
+   the same Continuous Array Read, one cache page per transfer. The window
+   doubles each time the reader comes back for more. Detection is per 
+   reader in ra, start is the page it misses next and size the window.
+   Cache lock held, it is dropped while the window streams in. */
+static struct flash_cache_page *cache_readahead(struct spi_flash_prv *prv,
+                                                struct flash_xfer *xfer,
+                                                struct file_ra_state *ra,
+                                                unsigned int page)
+{
+  uint8_t     *cmd = xfer ? xfer->cmd : prv->cmd;
+  int          retval;
+  unsigned int ii, count, window;
+  struct flash_cache_page **cps, *cp = NULL;
+  struct spi_transfer      *t;
+  struct spi_message        m;
+
+  /* Half the cache at most so a stream does not evict its own pages */
+  window = min_t(unsigned int, (readahead_kb * 1024) / prv->page_size, 
+                 prv->cache_max / 2);
+  if(page != ra->start || window < 2)
+  {
+    ra->size  = 0;
+    ra->start = page + 1;
+    return cache_fill(prv, xfer, page);
+  }
+
+  ra->size = max_t(unsigned int, ra->size * 2, FLASH_RA_MIN_PAGES);
+  ra->size = min(ra->size, window);
+  count    = min(ra->size, prv->max_pages - page);
+
+  cps = kmalloc_array(count, sizeof(*cps), GFP_KERNEL);
+  t   = kcalloc(count + 1, sizeof(*t), GFP_KERNEL);
+  if(cps == NULL || t == NULL)
+  {
+    kfree(cps);
+    kfree(t);
+    return cache_fill(prv, xfer, page);
+  }
+
+  /* The window ends early at a page that is already cached */
+  for(ii = 0; ii < count; ii++)
+  {
+    if(ii > 0 && NULL != cache_find(prv, page + ii))
+      break;
+    cps[ii] = cache_reserve(prv, xfer != NULL);
+    if(cps[ii] == NULL)
+      break;
+  }
+  count = ii;
+  ra->start = page + max(count, 1U);
+
+  if(count)
+  {
+    /* Other readers keep using the cache meanwhile. The pages are not in 
+       it yet, so nobody sees them half read. Writers are kept out by the
+       bus lock, so the data is still current when they go in. */
+    mutex_unlock(&prv->cache_lock);
+
+    spi_message_init(&m);
+    t[0].tx_buf   = cmd;
+    t[0].len      = read_command(prv, cmd, page * prv->page_size);
+    t[0].speed_hz = prv->read_hz;
+    spi_message_add_tail(&t[0], &m);
+    for(ii = 0; ii < count; ii++)
+    {
+      t[ii + 1].rx_buf   = cps[ii]->data;
+      t[ii + 1].len      = prv->page_size;
+      t[ii + 1].speed_hz = prv->read_hz;
+      spi_message_add_tail(&t[ii + 1], &m);
+    }
+    retval = flash_sync(prv, &m, cmd[0], page, count * prv->page_size,
+                        FLASH_LAT_READ);
+
+    mutex_lock(&prv->cache_lock);
+
+    /* Another reader may have brought some of the pages in already */
+    for(ii = 0; ii < count; ii++)
+    {
+      if(0 != retval || NULL != cache_find(prv, page + ii))
+        cache_unreserve(prv, cps[ii]);
+      else
+        cache_insert(prv, cps[ii], page + ii);
+    }
+    if(0 == retval)
+      cp = cache_find(prv, page);
+  }
+  kfree(cps);
+  kfree(t);
+
+  return cp;
+}
+
+/* Forget cached pages first .. first + count - 1 (they were erased) */
+static void cache_drop(struct spi_flash_prv *prv, unsigned int first,
+                       unsigned int count)
+{
+  struct flash_cache_page *cp, *tmp;
+
+  list_for_each_entry_safe(cp, tmp, &prv->cache_lru, lru)
+  {
+    if(cp->page >= first && cp->page - first < count)
+      cache_free(prv, cp);
+  }
+}
+
+static void cache_flush_work(struct work_struct *work)
+{
+  struct spi_flash_prv *prv = container_of(to_delayed_work(work), 
+                                         struct spi_flash_prv, flush_work);
+
+  if(0 != flash_lock(prv, false, false))
+    return;
+  cache_flush(prv);
+  flash_unlock(prv, false);
+}
+
+/*
+   Read len bytes at pos into a kernel buffer, lock held.
+   Cached pages (possibly dirty) are served from RAM. Small reads pull 
+   their pages into the cache, with read-ahead when they come in order,
+   see cache_readahead(). Larger ones stream the uncached runs with
+   one Continuous Array Read each so a dump does not flush the hot pages.
+   Shared holders pass their transfer buffer set for the command bytes, 
+   see cache_fill(). The cache lock is dropped while streaming so readers
+   only serialise on the SPI bus itself. ra is the read-ahead state of the
+   reader's file, NULL for users without one.
+*/
+static int flash_read(struct spi_flash_prv *prv, struct flash_xfer *xfer,
+                      struct file_ra_state *ra, loff_t pos, uint8_t *buf, 
+                      size_t len)
+{
+  int          retval;
+  bool         fill = (len <= FLASH_CACHE_FILL_MAX);
+  unsigned int page, last, offset;
+  size_t       chunk;
+  struct flash_cache_page *cp;
+
+  if(prv->ftl)
+    return ftl_read(prv, xfer, pos, buf, len);
+
+  while(len)
+  {
+    page   = pos / prv->page_size;
+    offset = pos % prv->page_size;
+
+    mutex_lock(&prv->cache_lock);
+    cp = cache_find(prv, page);
+    if(cp == NULL && fill)
+      cp = cache_readahead(prv, xfer, ra ? ra : &prv->ra, page);
+
+    if(cp != NULL)
+    {
+      chunk = min_t(size_t, len, prv->page_size - offset);
+      memcpy(buf, cp->data + offset, chunk);
+      list_move(&cp->lru, &prv->cache_lru);
+      mutex_unlock(&prv->cache_lock);
+    }
+    else
+    {
+      /* Extend the run up to the next cached page */
+      chunk = min_t(size_t, len, prv->page_size - offset);
+      for(last = page + 1; chunk < len && NULL == cache_find(prv, last); last++)
+        chunk = min_t(size_t, len, chunk + prv->page_size);
+      mutex_unlock(&prv->cache_lock);
+
+      retval = read_array(prv, xfer ? xfer->cmd : prv->cmd, pos, buf, chunk);
+      if(0 != retval)
+        return retval;
+    }
+    pos += chunk;
+    buf += chunk;
+    len -= chunk;
+  }
+  return SUCCESS;
+}
+
+/* Reload the mmap pages overlapping len bytes at pos after the flash 
+   contents changed there, lock held. Mappings always see current data. */
+static void mmap_refresh(struct spi_flash_prv *prv, loff_t pos, size_t len)
+{
+  pgoff_t      index, last;
+  loff_t       start, flash_size;
+  struct page *page;
+
+  flash_size = prv->size;
+  if(len == 0 || pos >= flash_size)
+    return;
+
+  last = (min_t(loff_t, pos + len, flash_size) - 1) >> PAGE_SHIFT;
+  for(index = pos >> PAGE_SHIFT; index <= last; index++)
+  {
+    page = radix_tree_lookup(&prv->mmap_pages, index);
+    if(page == NULL)
+      continue;
+
+    start = (loff_t)index << PAGE_SHIFT;
+    flash_read(prv, NULL, NULL, start, page_address(page), 
+               min_t(loff_t, PAGE_SIZE, flash_size - start));
+  }
+}
+
+/* Mark len bytes at offset of a cached page as newer than the flash.
+   Writes to the same page widen one range, the bytes in between are the
+   cached copy of the flash and go back unchanged. */
+static void cache_mark_dirty(struct spi_flash_prv *prv, 
+                             struct flash_cache_page *cp, 
+                             unsigned int offset, size_t len)
+{
+  if(!cp->dirty)
+  {
+    cp->dirty       = true;
+    cp->dirty_start = offset;
+    cp->dirty_end   = offset + len;
+    prv->cache_dirty++;
+    return;
+  }
+  cp->dirty_start = min_t(unsigned int, cp->dirty_start, offset);
+  cp->dirty_end   = max_t(unsigned int, cp->dirty_end, offset + len);
+}
+
+/* Write len bytes at byte address pos into the cache, lock held.
+   Pages are only marked dirty, they reach flash on the next flush with
+   just the bytes that changed. A partial page that is not cached goes 
+   straight to flash instead, reading it in would cost a whole page each
+   way for a few new bytes. */
+static int cache_write(struct spi_flash_prv *prv, loff_t pos,
+                       const uint8_t *data, size_t len)
+{
+  size_t       chunk;
+  unsigned int page, offset;
+  struct flash_cache_page *cp;
+
+  for(; len; pos += chunk, data += chunk, len -= chunk)
+  {
+    page   = pos / prv->page_size;
+    offset = pos % prv->page_size;
+    chunk  = min_t(size_t, len, prv->page_size - offset);
+
+    cp = cache_find(prv, page);
+    if(cp == NULL && chunk == prv->page_size)
+    {
+      mutex_lock(&prv->cache_lock);
+      cp = cache_alloc(prv, page, false);
+      mutex_unlock(&prv->cache_lock);
+    }
+    if(cp == NULL)
+    {
+      /* Partial page or no room in the cache, write through instead */
+      int retval = program_range(prv, pos, data, chunk);
+      if(0 != retval)
+        return retval;
+      continue;
+    }
+
+    memcpy(cp->data + offset, data, chunk);
+    list_move(&cp->lru, &prv->cache_lru);
+    cache_mark_dirty(prv, cp, offset, chunk);
+  }
+
+  /* Collapse further writes to the same pages until the timer runs */
+  if(prv->cache_dirty)
+    schedule_delayed_work(&prv->flush_work, msecs_to_jiffies(flush_ms));
+
+  return SUCCESS;
+}
+
+/* Program len bytes at byte address pos straight to flash, lock held 
+   exclusively. Cached copies of the pages take the new bytes as well, 
+   a dirty one keeps its other unwritten bytes for the next flush. After
+   a failure the range is undefined, on the chip and in the cache alike. */
+static int flash_write_through(struct spi_flash_prv *prv, loff_t pos,
+                               const uint8_t *data, size_t len)
+{
+  int          retval;
+  size_t       chunk, done;
+  unsigned int page, offset;
+  struct flash_cache_page *cp;
+
+  retval = program_range(prv, pos, data, len);
+
+  for(done = 0; done < len; done += chunk)
+  {
+    page   = (pos + done) / prv->page_size;
+    offset = (pos + done) % prv->page_size;
+    chunk  = min_t(size_t, len - done, prv->page_size - offset);
+
+    cp = cache_find(prv, page);
+    if(cp != NULL)
+      memcpy(cp->data + offset, data + done, chunk);
+  }
+  mmap_refresh(prv, pos, len);
+
+  return retval;
+}
+
+/* Write len bytes at byte address pos, lock held */
+static int flash_write(struct spi_flash_prv *prv, loff_t pos,
+                       const uint8_t *data, size_t len)
+{
+  int retval;
+
+  if(prv->ftl)
+    retval = ftl_write(prv, pos, data, len);
+  else if(prv->cache_max)
+    retval = cache_write(prv, pos, data, len);
+  else
+    retval = program_range(prv, pos, data, len);
+
+  mmap_refresh(prv, pos, len);
+
+  return retval;
+}
+
+/* Take a transfer buffer set from the pool, waiting for one to be 
+   returned unless the request is non blocking */
+static struct flash_xfer *xfer_try_get(struct spi_flash_prv *prv)
+{
+  struct flash_xfer *xfer;
+
+  spin_lock(&prv->xfer_lock);
+  xfer = list_first_entry_or_null(&prv->xfer_free, struct flash_xfer, list);
+  if(xfer)
+    list_del(&xfer->list);
+  spin_unlock(&prv->xfer_lock);
+
+  return xfer;
+}
+
+static struct flash_xfer *xfer_get(struct spi_flash_prv *prv, bool nowait)
+{
+  struct flash_xfer *xfer;
+
+  if(nowait)
+    return xfer_try_get(prv);
+
+  wait_event(prv->xfer_wait, (xfer = xfer_try_get(prv)) != NULL);
+  return xfer;
+}
+
+static void xfer_put(struct spi_flash_prv *prv, struct flash_xfer *xfer)
+{
+  spin_lock(&prv->xfer_lock);
+  list_add(&xfer->list, &prv->xfer_free);
+  spin_unlock(&prv->xfer_lock);
+
+  wake_up(&prv->xfer_wait);
+}
+
+/* Allocate the transfer buffers once at probe. kmalloc memory is physically
+   contiguous and cache line aligned, so it can be handed to the controller
+   for DMA as it is and no per call allocation or copy is needed. They are
+   not device managed, devres puts its header in front of the data and 
+   only keeps that 8 byte aligned, so the buffers would share cache lines
+   with it. xfer_pool_free() releases them, also after a partial setup. */
+static int xfer_pool_alloc(struct spi_flash_prv *prv)
+{
+  unsigned int ii, count = max_t(unsigned int, xfer_buffers, 1);
+
+  spin_lock_init(&prv->xfer_lock);
+  init_waitqueue_head(&prv->xfer_wait);
+  INIT_LIST_HEAD(&prv->xfer_free);
+
+  /* Command bytes and the response read back after them */
+  prv->cmd  = kzalloc(2 * L1_CACHE_BYTES, GFP_KERNEL);
+  prv->xfer = kcalloc(count, sizeof(*prv->xfer), GFP_KERNEL);
+  if(prv->cmd == NULL || prv->xfer == NULL)
+    return -ENOMEM;
+  prv->xfer_count = count;
+
+  for(ii = 0; ii < count; ii++)
+  {
+    prv->xfer[ii].cmd  = kzalloc(L1_CACHE_BYTES, GFP_KERNEL);
+    prv->xfer[ii].data = kmalloc(FLASH_READ_CHUNK, GFP_KERNEL);
+    if(prv->xfer[ii].cmd == NULL || prv->xfer[ii].data == NULL)
+      return -ENOMEM;
+    list_add_tail(&prv->xfer[ii].list, &prv->xfer_free);
+  }
+  return SUCCESS;
+}
+
+static void xfer_pool_free(struct spi_flash_prv *prv)
+{
+  unsigned int ii;
+
+  for(ii = 0; prv->xfer && ii < prv->xfer_count; ii++)
+  {
+    kfree(prv->xfer[ii].cmd);
+    kfree(prv->xfer[ii].data);
+  }
+  kfree(prv->xfer);
+  kfree(prv->cmd);
+}
+
+/* Last reference dropped, remove has run and no file or mapping is left.
+   Also cleans up after a failed probe, anything not set up yet is NULL. */
+static void spi_flash_free(struct kref *ref)
+{
+  struct spi_flash_prv *prv = container_of(ref, struct spi_flash_prv, ref);
+
+  /* Lets the last asynchronous completions run to the end */
+  if(prv->aio_wq)
+    destroy_workqueue(prv->aio_wq);
+  xfer_pool_free(prv);
+  kfree(prv->ftl_buf);
+  kfree(prv->ftl_map);
+  kfree(prv->ftl_state);
+  kfree(prv->rewrite_count);
+  free_percpu(prv->stats);
+  spi_dev_put(prv->spidev);
+  kfree(prv);
+}
+
+static int device_open(struct inode *inode, struct file *file)
+{
+  struct spi_flash_prv *prv;
+
+  /* The misc core points private_data at the miscdevice that was opened,
+     swap it for the chip behind it. Any number of users may have it open,
+     each with its own file position in f_pos. */
+  prv = container_of(file->private_data, struct spi_flash_prv, misc);
+  file->private_data = prv;
+
+  /* misc_open() holds the misc lock, so remove cannot have dropped the 
+     last reference before we take ours */
+  kref_get(&prv->ref);
+
+  /* ID and geometry were read and the page size set up at probe, so
+     opening the device costs no bus traffic */
+  return SUCCESS;
+}
+
+static int device_release(struct inode *inode, struct file *file)
+{
+  struct spi_flash_prv *prv = file->private_data;
+
+  /* Dirty pages are written back whenever a user goes away, remove has
+     done so already once the chip is gone. With nothing dirty the chip
+     is left asleep, cache_flush() checks again under the lock. */
+  if(READ_ONCE(prv->cache_dirty) && 0 == flash_lock(prv, false, false))
+  {
+    cache_flush(prv);
+    flash_unlock(prv, false);
+  }
+  kref_put(&prv->ref, spi_flash_free);
+
+  return SUCCESS;
+}
+
+static int device_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+  struct spi_flash_prv *prv = filp->private_data;
+  int retval;
+
+  if(prv->gone)
+    return -ENODEV;
+
+  /* Writes of the FTL and without cache are on the chip already, with
+     nothing dirty the chip is left asleep */
+  if(READ_ONCE(prv->cache_dirty) == 0)
+    return SUCCESS;
+
+  retval = flash_lock(prv, false, false);
+  if(0 != retval)
+    return retval;
+  retval = cache_flush(prv);
+  flash_unlock(prv, false);
+
+  return retval;
+}
+
+/* True when every page of len bytes at pos is in the page cache */
+static bool cache_covers(struct spi_flash_prv *prv, loff_t pos, size_t len)
+{
+  bool         covered = true;
+  unsigned int page, last;
+
+  if(len == 0)
+    return true;
+
+  mutex_lock(&prv->cache_lock);
+  last = (pos + len - 1) / prv->page_size;
+  for(page = pos / prv->page_size; page <= last && covered; page++)
+    covered = (NULL != cache_find(prv, page));
+  mutex_unlock(&prv->cache_lock);
+
+  return covered;
+}
+
+/* True when any page of len bytes at pos is in the page cache */
+static bool cache_overlaps(struct spi_flash_prv *prv, loff_t pos, size_t len)
+{
+  unsigned int page, last;
+
+  if(len == 0 || prv->cache_count == 0)
+    return false;
+
+  last = (pos + len - 1) / prv->page_size;
+  for(page = pos / prv->page_size; page <= last; page++)
+  {
+    if(NULL != cache_find(prv, page))
+      return true;
+  }
+  return false;
+}
+
+/* Runs in process context once the SPI part of a request is done.
+   Read data is copied into the submitter's buffers through its mm. */
+static void aio_complete_work(struct work_struct *work)
+{
+  size_t                copied;
+  ssize_t               result;
+  struct flash_aio     *req = container_of(work, struct flash_aio, work);
+  struct spi_flash_prv *prv = req->prv;
+  struct kiocb         *iocb = req->iocb;
+
+  if(!req->write && req->result > 0)
+  {
+    use_mm(req->mm);
+    copied = copy_to_iter(req->xfer->data, req->result, &req->iter);
+    unuse_mm(req->mm);
+
+    if(copied != req->result)
+      req->result = copied ? copied : -EFAULT;
+  }
+  if(req->mm)
+    mmput(req->mm);
+  result = req->result;
+
+  kfree(req->iov);
+  xfer_put(prv, req->xfer);
+  kfree(req);
+
+  atomic_dec(&prv->aio_inflight);
+  wake_up(&prv->aio_wait);
+
+  /* Last, completing may close the file and drop its reference on prv */
+  iocb->ki_complete(iocb, result, 0);
+}
+
+/* SPI controller callback for an asynchronous Continuous Array Read */
+static void aio_spi_complete(void *context)
+{
+  struct flash_aio     *req = context;
+  struct spi_flash_prv *prv = req->prv;
+  s64                   ns  = ktime_to_ns(ktime_sub(ktime_get(), req->start));
+
+  req->result = req->m.status ? req->m.status : (ssize_t)req->len;
+  if(0 != req->m.status)
+    this_cpu_inc(prv->stats->count[FLASH_STAT_ERRORS]);
+  stat_xfer(prv, FLASH_LAT_READ, req->len, ns, req->m.status);
+  trace_spi_flash_cmd_complete(prv->name, req->xfer->cmd[0], 
+                               (uint32_t)req->pos / prv->page_size, req->len,
+                               ns, req->m.status, 0);
+  queue_work(prv->aio_wq, &req->work);
+
+  /* Last message of the batch lets the dispatcher release the bus */
+  if(atomic_dec_and_test(&prv->aio_pending))
+    complete(&prv->aio_done);
+}
+
+/* Build and submit the read message, the request completes from the
+   controller callback */
+static int aio_submit_read(struct spi_flash_prv *prv, struct flash_aio *req)
+{
+  uint8_t *cmd = req->xfer->cmd;
+
+  /* Messages of a batch are in flight together, so each one carries its
+     own command bytes */
+  spi_message_init(&req->m);
+  memset(req->t, 0, sizeof(req->t));
+
+  req->t[0].tx_buf   = cmd;
+  req->t[0].len      = read_command(prv, cmd, req->pos);
+  req->t[0].speed_hz = prv->read_hz;
+  spi_message_add_tail(&req->t[0], &req->m);
+
+  req->t[1].rx_buf   = req->xfer->data;
+  req->t[1].len      = req->len;
+  req->t[1].speed_hz = prv->read_hz;
+  spi_message_add_tail(&req->t[1], &req->m);
+
+  req->m.complete = aio_spi_complete;
+  req->m.context  = req;
+
+  req->start = ktime_get();
+  trace_spi_flash_cmd_issue(prv->name, cmd[0], (uint32_t)req->pos / prv->page_size, 
+                            req->len);
+
+  atomic_inc(&prv->aio_pending);
+
+  return spi_async(prv->spidev, &req->m);
+}
+
+/*
+   Asynchronous submission queue dispatcher.
+   All queued reads are handed to the controller with spi_async() in one 
+   go so its queue stays full, and the bus lock is held until the last one
+   completes so no program or erase can start under them. Reads touching 
+   cached pages (which may be newer than the flash) and writes (which need the program sequence with ready
+   polling) are carried out here, off the submitter's thread.
+*/
+static void aio_dispatch_work(struct work_struct *work)
+{
+  struct spi_flash_prv *prv = container_of(work, struct spi_flash_prv, 
+                                         aio_work);
+  int               retval;
+  bool              shared = true, cached;
+  struct flash_aio *req, *tmp;
+  LIST_HEAD(batch);
+
+  spin_lock(&prv->aio_lock);
+  list_splice_init(&prv->aio_queue, &batch);
+  spin_unlock(&prv->aio_lock);
+
+  if(list_empty(&batch))
+    return;
+
+  /* A batch of reads shares the bus with the other readers, every request
+     brings its own transfer buffers */
+  list_for_each_entry(req, &batch, list)
+  {
+    if(req->write)
+      shared = false;
+  }
+
+  /* Queued just before remove, nothing is left to serve the batch */
+  retval = flash_lock(prv, false, shared);
+  if(0 != retval)
+  {
+    list_for_each_entry_safe(req, tmp, &batch, list)
+    {
+      list_del(&req->list);
+      req->result = retval;
+      queue_work(prv->aio_wq, &req->work);
+    }
+    return;
+  }
+
+  /* Bias keeps the completion from firing while we are still submitting */
+  reinit_completion(&prv->aio_done);
+  atomic_set(&prv->aio_pending, 1);
+
+  list_for_each_entry_safe(req, tmp, &batch, list)
+  {
+    list_del(&req->list);
+
+    /* Shared readers fill the cache concurrently, walk it locked */
+    mutex_lock(&prv->cache_lock);
+    cached = cache_overlaps(prv, req->pos, req->len);
+    mutex_unlock(&prv->cache_lock);
+
+    if(req->write)
+      retval = flash_write(prv, req->pos, req->xfer->data, req->len);
+    else if(prv->ftl || cached)
+      retval = flash_read(prv, req->xfer, &req->iocb->ki_filp->f_ra, req->pos, 
+                          req->xfer->data, req->len);
+    else
+    {
+      retval = aio_submit_read(prv, req);
+      if(0 == retval)
+        continue;
+      atomic_dec(&prv->aio_pending);
+    }
+
+    req->result = retval ? retval : (ssize_t)req->len;
+    queue_work(prv->aio_wq, &req->work);
+  }
+
+  if(!atomic_dec_and_test(&prv->aio_pending))
+    wait_for_completion(&prv->aio_done);
+
+  flash_unlock(prv, shared);
+}
+
+/* Queue a request for the dispatcher and return -EIOCBQUEUED */
+static ssize_t aio_submit(struct spi_flash_prv *prv, struct kiocb *iocb,
+                          struct iov_iter *iter, bool write, loff_t pos,
+                          size_t len, bool nowait)
+{
+  struct flash_aio *req;
+
+  /* Bound the number of requests in flight */
+  while(atomic_inc_return(&prv->aio_inflight) > aio_depth)
+  {
+    atomic_dec(&prv->aio_inflight);
+    if(nowait)
+      return -EAGAIN;
+    wait_event(prv->aio_wait, atomic_read(&prv->aio_inflight) < aio_depth);
+  }
+
+  req = kzalloc(sizeof(*req), GFP_KERNEL);
+  if(req == NULL)
+    goto err_inflight;
+
+  /* The request owns its transfer buffers until it completes */
+  req->xfer = xfer_get(prv, nowait);
+  if(req->xfer == NULL)
+  {
+    kfree(req);
+    atomic_dec(&prv->aio_inflight);
+    return -EAGAIN;
+  }
+
+  req->prv   = prv;
+  req->iocb  = iocb;
+  req->write = write;
+  req->pos   = pos;
+  req->len   = len;
+  INIT_WORK(&req->work, aio_complete_work);
+
+  if(write)
+  {
+    /* Data is taken now, the submitter may reuse its buffer */
+    if(len != copy_from_iter(req->xfer->data, len, iter))
+    {
+      xfer_put(prv, req->xfer);
+      kfree(req);
+      atomic_dec(&prv->aio_inflight);
+      return -EFAULT;
+    }
+  }
+  else
+  {
+    /* Destination is filled later from the completion worker */
+    req->iov = dup_iter(&req->iter, iter, GFP_KERNEL);
+    if(req->iov == NULL)
+      goto err_buf;
+    req->mm = current->mm;
+    mmget(req->mm);
+  }
+
+  spin_lock(&prv->aio_lock);
+  list_add_tail(&req->list, &prv->aio_queue);
+  spin_unlock(&prv->aio_lock);
+
+  queue_work(prv->aio_wq, &prv->aio_work);
+
+  return -EIOCBQUEUED;
+
+err_buf:
+  xfer_put(prv, req->xfer);
+  kfree(req);
+err_inflight:
+  atomic_dec(&prv->aio_inflight);
+  return -ENOMEM;
+}
+
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+  struct spi_flash_prv *prv = iocb->ki_filp->private_data;
+  int      retval = 0;
+  bool     nowait = iocb_nowait(iocb);
+  size_t   done = 0, chunk, size;
+  loff_t   pos = iocb->ki_pos, flash_size;
+  uint8_t *tmp;
+  struct flash_xfer *xfer;
+
+  if(prv->gone)
+    return -ENODEV;
+
+  flash_size = prv->size;
+  size       = iov_iter_count(to);
+
+  /* Reads are clipped at the end of the device */
+  if(pos >= flash_size)
+    return 0;
+  if(size > flash_size - pos)
+    size = flash_size - pos;
+
+  /* AIO requests are served by the submission queue, one chunk each */
+  if(!is_sync_kiocb(iocb))
+    return aio_submit(prv, iocb, to, false, pos, 
+                      min_t(size_t, size, FLASH_READ_CHUNK), nowait);
+
+  /* DMA-safe buffer for one chunk, each chunk is a single SPI command */
+  xfer = xfer_get(prv, nowait);
+  if(xfer == NULL)
+    return -EAGAIN;
+  tmp = xfer->data;
+
+  while(done < size)
+  {
+    chunk = min_t(size_t, size - done, FLASH_READ_CHUNK);
+
+    /* Readers share the bus lock, other readers keep streaming */
+    retval = flash_lock(prv, nowait, true);
+    if(0 != retval)
+      break;
+    /* Non blocking reads are served from the page cache only */
+    if(nowait && !cache_covers(prv, pos + done, chunk))
+      retval = -EAGAIN;
+    else
+      retval = flash_read(prv, xfer, &iocb->ki_filp->f_ra, pos + done, tmp, chunk);
+    flash_unlock(prv, true);
+    if(0 != retval)
+      break;
+
+    /* Safely copy data from temporary buffer to the user buffer, done
+       without the lock as the copy may fault */
+    if(chunk != copy_to_iter(tmp, chunk, to))
+    {
+      pr_info("Partial Copy\r\n");
+      retval = -EFAULT;
+      break;
+    }
+    done += chunk;
+  }
+  xfer_put(prv, xfer);
+
+  /* Advance the file offset by what was actually delivered */
+  iocb->ki_pos += done;
+
+  return done ? done : retval;
+}
+
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+  struct spi_flash_prv *prv = iocb->ki_filp->private_data;
+  int      retval = 0;
+  bool     nowait = iocb_nowait(iocb);
+  size_t   done = 0, chunk, size;
+  loff_t   pos = iocb->ki_pos, flash_size;
+  uint8_t *tmp;
+  struct flash_xfer *xfer;
+
+  /* Writes land at the file offset, any byte within a page. Only the 
+     pages touched are reprogrammed and only the new bytes are sent */
+  if(prv->gone)
+    return -ENODEV;
+
+  flash_size = prv->size;
+  size       = iov_iter_count(from);
+  if(pos >= flash_size)
+    return -ENOSPC;
+  if(size > flash_size - pos)
+    size = flash_size - pos;
+
+  if(!is_sync_kiocb(iocb))
+    return aio_submit(prv, iocb, from, true, pos,
+                      min_t(size_t, size, FLASH_READ_CHUNK), nowait);
+
+  xfer = xfer_get(prv, nowait);
+  if(xfer == NULL)
+    return -EAGAIN;
+  tmp = xfer->data;
+
+  while(done < size)
+  {
+    chunk = min_t(size_t, size - done, FLASH_READ_CHUNK);
+
+    /* Safely Copy User Buffer Data to Temporary Buffer */
+    if(chunk != copy_from_iter(tmp, chunk, from))
+    {
+      pr_info("Partial Copy\r\n");
+      retval = -EFAULT;
+      break;
+    }
+
+    retval = flash_lock(prv, nowait, false);
+    if(0 != retval)
+      break;
+    retval = flash_write(prv, pos + done, tmp, chunk);
+    flash_unlock(prv, false);
+    if(0 != retval)
+    {
+      pr_info("SPI Failed\r\n");
+      break;
+    }
+    done += chunk;
+  }
+  xfer_put(prv, xfer);
+
+  iocb->ki_pos += done;
+
+  return done ? done : retval;
+}
+
+/* Look up a kernel page kept for mmap and take a reference on it for 
+   the mapping, ours stays in the tree. Pages only come and go under the
+   cache lock, which unlike the bus lock does not wake the chip. */
+static struct page *mmap_get_page(struct spi_flash_prv *prv, pgoff_t index)
+{
+  struct page *page;
+
+  mutex_lock(&prv->cache_lock);
+  page = radix_tree_lookup(&prv->mmap_pages, index);
+  if(page != NULL)
+    get_page(page);
+  mutex_unlock(&prv->cache_lock);
+
+  return page;
+}
+
+/* Fill a kernel page from flash on first touch and keep it for later 
+   faults. Private writable mappings get their copy from the core. */
+static int device_vm_fault(struct vm_fault *vmf)
+{
+  struct spi_flash_prv *prv = vmf->vma->vm_private_data;
+  int          retval;
+  loff_t       start, flash_size;
+  struct page *page;
+
+  flash_size = prv->size;
+  start      = (loff_t)vmf->pgoff << PAGE_SHIFT;
+  if(start >= flash_size)
+    return VM_FAULT_SIGBUS;
+
+  /* A page loaded before costs no bus traffic */
+  page = mmap_get_page(prv, vmf->pgoff);
+  if(page != NULL)
+  {
+    vmf->page = page;
+    return SUCCESS;
+  }
+
+  /* Taken exclusively so no writer changes the range while it is read.
+     A fault happens once per page, so readers are not held up for long */
+  if(0 != flash_lock(prv, false, false))
+    return VM_FAULT_SIGBUS;
+
+  /* Another fault may have loaded it while we waited */
+  page = mmap_get_page(prv, vmf->pgoff);
+  if(page == NULL)
+  {
+    page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if(page == NULL)
+    {
+      flash_unlock(prv, false);
+      return VM_FAULT_OOM;
+    }
+
+    retval = flash_read(prv, NULL, NULL, start, page_address(page), 
+                        min_t(loff_t, PAGE_SIZE, flash_size - start));
+    if(0 == retval)
+    {
+      mutex_lock(&prv->cache_lock);
+      retval = radix_tree_insert(&prv->mmap_pages, vmf->pgoff, page);
+      mutex_unlock(&prv->cache_lock);
+    }
+    if(0 != retval)
+    {
+      flash_unlock(prv, false);
+      __free_page(page);
+      return (retval == -ENOMEM) ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+    }
+    /* Reference for the mapping */
+    get_page(page);
+  }
+  vmf->page = page;
+
+  flash_unlock(prv, false);
+
+  return SUCCESS;
+}
+
+/* A mapping keeps prv around like an open file, it may outlive both the
+   file and the device. open is called for copies made by fork and split */
+static void device_vm_open(struct vm_area_struct *vma)
+{
+  struct spi_flash_prv *prv = vma->vm_private_data;
+
+  kref_get(&prv->ref);
+}
+
+static void device_vm_close(struct vm_area_struct *vma)
+{
+  struct spi_flash_prv *prv = vma->vm_private_data;
+
+  kref_put(&prv->ref, spi_flash_free);
+}
+
+static const struct vm_operations_struct device_vm_ops = {
+  .open  = device_vm_open,
+  .close = device_vm_close,
+  .fault = device_vm_fault,
+};
+
+static int device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+  struct spi_flash_prv *prv = filp->private_data;
+  unsigned long pages, max_pages;
+
+  if(prv->gone)
+    return -ENODEV;
+
+  /* Shared mappings are read only, stores would never reach the flash */
+  if(vma->vm_flags & VM_SHARED)
+  {
+    if(vma->vm_flags & VM_WRITE)
+      return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+  }
+
+  pages     = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+  max_pages = DIV_ROUND_UP(prv->size, PAGE_SIZE);
+  if(vma->vm_pgoff >= max_pages || pages > max_pages - vma->vm_pgoff)
+    return -EINVAL;
+
+  vma->vm_ops          = &device_vm_ops;
+  vma->vm_private_data = prv;
+  vma->vm_flags       |= VM_DONTEXPAND;
+  /* The core does not call open for the first mapping */
+  device_vm_open(vma);
+
+  return SUCCESS;
+}
+
+/* Drop the kernel pages kept for mmap, mappings hold their own references */
+static void mmap_release_pages(struct spi_flash_prv *prv)
+{
+  pgoff_t      index, max_pages;
+  struct page *page;
+
+  max_pages = DIV_ROUND_UP(prv->size, PAGE_SIZE);
+  mutex_lock(&prv->cache_lock);
+  for(index = 0; index < max_pages; index++)
+  {
+    page = radix_tree_delete(&prv->mmap_pages, index);
+    if(page != NULL)
+      put_page(page);
+  }
+  mutex_unlock(&prv->cache_lock);
+}
+
+static loff_t device_llseek(struct file *filp, loff_t offset, int whence)
+{
+  struct spi_flash_prv *prv = filp->private_data;
+
+  return fixed_size_llseek(filp, offset, whence, prv->size);
+}
+
+static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct spi_flash_prv *prv = filp->private_data;
+  int err = 0;
+  unsigned int val = 0;
+  unsigned int pages, page_size;
+  struct flash_erase_range range;
+
+  unsigned int *ptr = (unsigned int *)arg;
+
+  /* Check if Magic Number is Matching */
+  if(_IOC_TYPE(cmd) != SPI_MAGIC)
+    return -ENOTTY;
+
+  /* Check if Command is within Range */
+  if(_IOC_NR(cmd) > MAX_IOCTL)
+    return -ENOTTY;
+
+  /* Check that the user space pointer is accessible */
+  if(_IOC_DIR(cmd) & _IOC_READ)
+    err = !access_ok(VERIFY_WRITE, (void *)arg, _IOC_SIZE(cmd));
 
   else if(_IOC_DIR(cmd) & _IOC_WRITE)
     err = !access_ok(VERIFY_READ, (void *)arg, _IOC_SIZE(cmd));
@@ -390,6 +3056,19 @@ static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
   if(err)
     return -EFAULT;
 
+  if(prv->gone)
+    return -ENODEV;
+
+  /* Physical erases would pull pages from under the translation layer */
+  if(prv->ftl && (cmd == ERASE_PAGE || cmd == ERASE_SECTOR || 
+                  cmd == ERASE_RANGE || cmd == ERASE_CHIP))
+    return -EOPNOTSUPP;
+
+  /* Users see the logical pages of the translation layer, smaller and 
+     fewer than the physical ones */
+  pages     = prv->ftl ? prv->ftl_pages : prv->max_pages;
+  page_size = prv->ftl ? FTL_PAYLOAD(prv) : prv->page_size;
+
   switch(cmd)
   {
     case GET_DEVICE_ID:
@@ -397,100 +3076,802 @@ static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
       break;
 
     case GET_MAX_PAGES:
-      put_user(prv->max_pages, ptr);
+      put_user(pages, ptr);
+      break;
+
+    case GET_PAGE_SIZE:
+      put_user(page_size, ptr);
       break;
  
     case GET_PAGE_OFFSET:
-      put_user(prv->current_page, ptr);
+      put_user((unsigned int)div_u64(filp->f_pos, page_size), ptr);
       break;
 
     case SET_PAGE_OFFSET:
-      get_user(prv->current_page, ptr);
+      get_user(val, ptr);
+      if(val >= pages)
+        return -EINVAL;
+      /* Reads and writes continue from the start of the selected page */
+      filp->f_pos = (loff_t)val * page_size;
+      break;
+
+    case SET_WRITE_MODE:
+      get_user(val, ptr);
+      if(val != WRITE_MODE_ERASE_PROGRAM && val != WRITE_MODE_COMPARE)
+        return -EINVAL;
+      down_write(&prv->lock);
+      prv->write_mode = val;
+      up_write(&prv->lock);
       break;
 
     case ERASE_PAGE:
       get_user(val, ptr);
-      erase_page(val);
+      if(val >= prv->max_pages)
+        return -EINVAL;
+      err = flash_lock(prv, false, false);
+      if(0 != err)
+        return err;
+      cache_drop(prv, val, 1);
+      err = erase_page(prv, val);
+      mmap_refresh(prv, (loff_t)val * prv->page_size, prv->page_size);
+      flash_unlock(prv, false);
       break;
 
     case ERASE_SECTOR:
       get_user(val, ptr);
-      erase_sector(val);
+      if(val >= prv->max_pages / prv->sector_pages)
+        return -EINVAL;
+      err = flash_lock(prv, false, false);
+      if(0 != err)
+        return err;
+      cache_drop(prv, val * prv->sector_pages, prv->sector_pages);
+      err = erase_sector(prv, val);
+      mmap_refresh(prv, (loff_t)val * prv->sector_pages * prv->page_size, 
+                   (size_t)prv->sector_pages * prv->page_size);
+      flash_unlock(prv, false);
       break;
   
+    case ERASE_RANGE:
+      if(0 != copy_from_user(&range, (void __user *)arg, sizeof(range)))
+        return -EFAULT;
+      if(range.start_page >= prv->max_pages || 
+         range.count > prv->max_pages - range.start_page)
+        return -EINVAL;
+      err = flash_lock(prv, false, false);
+      if(0 != err)
+        return err;
+      cache_drop(prv, range.start_page, range.count);
+      err = erase_range(prv, range.start_page, range.count);
+      mmap_refresh(prv, (loff_t)range.start_page * prv->page_size, 
+                   (size_t)range.count * prv->page_size);
+      flash_unlock(prv, false);
+      break;
+
     case ERASE_CHIP:
-      erase_chip();
+      err = flash_lock(prv, false, false);
+      if(0 != err)
+        return err;
+      cache_drop(prv, 0, UINT_MAX);
+      err = erase_chip(prv);
+      mmap_refresh(prv, 0, prv->size);
+      flash_unlock(prv, false);
       break;
   }
-  return SUCCESS;
+  /* Erases return once the device is ready again */
+  return err;
 }
 
-static struct file_operations device_fops = {
+static const struct file_operations device_fops = {
   .owner          = THIS_MODULE,
+  .llseek         = device_llseek,
   .open           = device_open,
   .release        = device_release,
-  .read           = device_read,
-  .write          = device_write,
+  .read_iter      = device_read_iter,
+  .write_iter     = device_write_iter,
+  .fsync          = device_fsync,
+  .mmap           = device_mmap,
   .unlocked_ioctl = device_ioctl,
 };
 
-static struct miscdevice device_misc = {
-  .minor = MISC_DYNAMIC_MINOR,
-  .name  = DEVICE_NAME,
-  .fops  = &device_fops,
+/* MTD Interface, lets the MTD character/block devices, UBI and JFFS2 
+   sit on top of the same cached read and program paths */
+static int spi_flash_mtd_read(struct mtd_info *mtd, loff_t from, size_t len,
+                              size_t *retlen, u_char *buf)
+{
+  struct spi_flash_prv *prv = mtd->priv;
+  int                retval;
+  struct flash_xfer *xfer;
+
+  /* Shared with other readers, the transfer set carries our command */
+  xfer = xfer_get(prv, false);
+  flash_lock(prv, false, true);
+  retval = flash_read(prv, xfer, NULL, from, buf, len);
+  flash_unlock(prv, true);
+  xfer_put(prv, xfer);
+
+  if(0 != retval)
+    return retval;
+
+  *retlen = len;
+  return SUCCESS;
+}
+
+static int spi_flash_mtd_write(struct mtd_info *mtd, loff_t to, size_t len,
+                               size_t *retlen, const u_char *buf)
+{
+  struct spi_flash_prv *prv = mtd->priv;
+  int retval;
+
+  /* UBI and JFFS2 take a finished write as durable and rarely sync, so 
+     the data is on the chip before we return and the page cache is 
+     bypassed. Partial pages are merged with their old contents in the 
+     SRAM buffer. */
+  flash_lock(prv, false, false);
+  retval = flash_write_through(prv, to, buf, len);
+  flash_unlock(prv, false);
+
+  if(0 != retval)
+    return retval;
+
+  *retlen = len;
+  return SUCCESS;
+}
+
+static int spi_flash_mtd_erase(struct mtd_info *mtd, struct erase_info *instr)
+{
+  struct spi_flash_prv *prv = mtd->priv;
+  int          retval = 0;
+  unsigned int page, count;
+
+  if((instr->addr % mtd->erasesize) || (instr->len % mtd->erasesize))
+    return -EINVAL;
+
+  page  = instr->addr / prv->page_size;
+  count = instr->len  / prv->page_size;
+
+  flash_lock(prv, false, false);
+  cache_drop(prv, page, count);
+  retval = erase_range(prv, page, count);
+  mmap_refresh(prv, instr->addr, instr->len);
+  flash_unlock(prv, false);
+
+  if(0 != retval)
+  {
+    instr->state     = MTD_ERASE_FAILED;
+    instr->fail_addr = MTD_FAIL_ADDR_UNKNOWN;
+    mtd_erase_callback(instr);
+    return -EIO;
+  }
+  instr->state = MTD_ERASE_DONE;
+  mtd_erase_callback(instr);
+
+  return SUCCESS;
+}
+
+/* Write back the page cache so data handed to MTD is on the chip */
+static void spi_flash_mtd_sync(struct mtd_info *mtd)
+{
+  struct spi_flash_prv *prv = mtd->priv;
+
+  flash_lock(prv, false, false);
+  cache_flush(prv);
+  flash_unlock(prv, false);
+}
+
+/* An MTD user let go, remove may be waiting for the last one */
+static void spi_flash_mtd_put_device(struct mtd_info *mtd)
+{
+  struct spi_flash_prv *prv = mtd->priv;
+
+  wake_up(&prv->mtd_wait);
+}
+
+static int spi_flash_mtd_register(struct spi_flash_prv *prv)
+{
+  struct mtd_info *mtd = &prv->mtd;
+
+  init_waitqueue_head(&prv->mtd_wait);
+  mtd->name         = dev_name(&prv->spidev->dev);
+  mtd->type         = MTD_DATAFLASH;
+  mtd->flags        = MTD_WRITEABLE;
+  mtd->size         = (uint64_t)prv->max_pages * prv->page_size;
+  mtd->erasesize    = prv->page_size;
+  mtd->writesize    = prv->page_size;
+  mtd->writebufsize = prv->page_size;
+  mtd->owner        = THIS_MODULE;
+  mtd->dev.parent   = &prv->spidev->dev;
+  mtd->priv         = prv;
+
+  mtd->_read        = spi_flash_mtd_read;
+  mtd->_write       = spi_flash_mtd_write;
+  mtd->_erase       = spi_flash_mtd_erase;
+  mtd->_sync        = spi_flash_mtd_sync;
+  mtd->_put_device  = spi_flash_mtd_put_device;
+
+  /* Partitions may be described in the device tree node */
+  mtd_set_of_node(mtd, prv->spidev->dev.of_node);
+
+  return mtd_device_register(mtd, NULL, 0);
+}
+
+/* 
+   Block Device Interface using blk-mq.
+   512 byte sectors are laid over the linear page space, pages that are
+   not a multiple of 512 bytes are patched like any other partial page 
+   write. The block layer
+   merges adjacent bios into one request covering a contiguous sector 
+   range, which is served by a single Continuous Array Read or one run of 
+   the pipelined page program engine through the page cache.
+*/
+static int spi_flash_queue_rq(struct blk_mq_hw_ctx *hctx,
+                              const struct blk_mq_queue_data *bd)
+{
+  struct spi_flash_prv *prv = hctx->queue->queuedata;
+  int             retval = 0;
+  uint8_t        *ptr;
+  void           *vaddr;
+  loff_t          pos;
+  unsigned int    len;
+  struct request *rq = bd->rq;
+  struct bio_vec  bvec;
+  struct req_iterator iter;
+  struct flash_xfer  *xfer;
+  bool                shared = (req_op(rq) == REQ_OP_READ);
+
+  blk_mq_start_request(rq);
+
+  pos = (loff_t)blk_rq_pos(rq) << 9;
+  len = blk_rq_bytes(rq);
+
+  /* Queue is flagged BLK_MQ_F_BLOCKING so we may sleep on the bus here.
+     Segments are gathered into one transfer buffer, which also bounds 
+     the request size */
+  xfer = xfer_get(prv, false);
+  flash_lock(prv, false, shared);
+
+  switch(req_op(rq))
+  {
+    case REQ_OP_READ:
+      retval = flash_read(prv, xfer, NULL, pos, xfer->data, len);
+      if(0 != retval)
+        break;
+      ptr = xfer->data;
+      rq_for_each_segment(bvec, rq, iter)
+      {
+        vaddr = kmap(bvec.bv_page);
+        memcpy(vaddr + bvec.bv_offset, ptr, bvec.bv_len);
+        kunmap(bvec.bv_page);
+        ptr += bvec.bv_len;
+      }
+      break;
+
+    case REQ_OP_WRITE:
+      ptr = xfer->data;
+      rq_for_each_segment(bvec, rq, iter)
+      {
+        vaddr = kmap(bvec.bv_page);
+        memcpy(ptr, vaddr + bvec.bv_offset, bvec.bv_len);
+        kunmap(bvec.bv_page);
+        ptr += bvec.bv_len;
+      }
+      retval = flash_write(prv, pos, xfer->data, len);
+      break;
+
+    case REQ_OP_FLUSH:
+      retval = cache_flush(prv);
+      break;
+
+    default:
+      retval = -EIO;
+      break;
+  }
+
+  flash_unlock(prv, shared);
+  xfer_put(prv, xfer);
+
+  blk_mq_end_request(rq, retval);
+
+  return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static const struct blk_mq_ops spi_flash_mq_ops = {
+  .queue_rq = spi_flash_queue_rq,
+};
+
+static const struct block_device_operations spi_flash_blk_fops = {
+  .owner = THIS_MODULE,
+};
+
+static int spi_flash_blk_register(struct spi_flash_prv *prv)
+{
+  int retval;
+
+  prv->blk_major = register_blkdev(0, prv->name);
+  if(prv->blk_major < 0)
+    return prv->blk_major;
+
+  prv->tag_set.ops          = &spi_flash_mq_ops;
+  prv->tag_set.nr_hw_queues = 1;
+  prv->tag_set.queue_depth  = 16;
+  prv->tag_set.numa_node    = NUMA_NO_NODE;
+  prv->tag_set.flags        = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+  prv->tag_set.driver_data  = prv;
+
+  retval = blk_mq_alloc_tag_set(&prv->tag_set);
+  if(retval < 0)
+    goto err_major;
+
+  prv->queue = blk_mq_init_queue(&prv->tag_set);
+  if(IS_ERR(prv->queue))
+  {
+    retval = PTR_ERR(prv->queue);
+    goto err_tag;
+  }
+  prv->queue->queuedata = prv;
+
+  blk_queue_logical_block_size(prv->queue, 512);
+  /* DataFlash pages are no valid physical block size */
+  blk_queue_physical_block_size(prv->queue, is_power_of_2(prv->page_size) ?
+                                max_t(unsigned int, prv->page_size, 512) : 512);
+  blk_queue_max_hw_sectors(prv->queue, FLASH_READ_CHUNK >> 9);
+  /* Page cache is volatile, have the block layer send flushes */
+  blk_queue_write_cache(prv->queue, true, false);
+
+  prv->disk = alloc_disk(FLASH_BLK_MINORS);
+  if(prv->disk == NULL)
+  {
+    retval = -ENOMEM;
+    goto err_queue;
+  }
+  prv->disk->major        = prv->blk_major;
+  prv->disk->first_minor  = 0;
+  prv->disk->fops         = &spi_flash_blk_fops;
+  prv->disk->queue        = prv->queue;
+  prv->disk->private_data = prv;
+  snprintf(prv->disk->disk_name, sizeof(prv->disk->disk_name), "%s_blk", prv->name);
+  set_capacity(prv->disk, prv->size >> 9);
+
+  add_disk(prv->disk);
+
+  return SUCCESS;
+
+err_queue:
+  blk_cleanup_queue(prv->queue);
+err_tag:
+  blk_mq_free_tag_set(&prv->tag_set);
+err_major:
+  unregister_blkdev(prv->blk_major, prv->name);
+  return retval;
+}
+
+static void spi_flash_blk_unregister(struct spi_flash_prv *prv)
+{
+  del_gendisk(prv->disk);
+  blk_cleanup_queue(prv->queue);
+  put_disk(prv->disk);
+  blk_mq_free_tag_set(&prv->tag_set);
+  unregister_blkdev(prv->blk_major, prv->name);
+}
+
+/* 
+   Statistics in debugfs, one directory per chip named after its device 
+   node. "stats" holds one counter per line, followed by the measured
+   times of each internally timed operation, and "histogram" one line of
+   latency buckets per operation class, under a header line with the 
+   lower bound of each bucket in us. Anything written to "reset" clears
+   both, except the operation counts and running averages wait_ready()
+   plans its polling with.
+*/
+static const char * const lat_names[FLASH_LAT_MAX] = {
+  [FLASH_OP_TRANSFER]     = "transfer",
+  [FLASH_OP_PROGRAM]      = "program",
+  [FLASH_OP_PAGE_ERASE]   = "page_erase",
+  [FLASH_OP_BLOCK_ERASE]  = "block_erase",
+  [FLASH_OP_SECTOR_ERASE] = "sector_erase",
+  [FLASH_OP_CHIP_ERASE]   = "chip_erase",
+  [FLASH_OP_REWRITE]      = "page_rewrite",
+  [FLASH_LAT_READ]        = "read",
+  [FLASH_LAT_BUFFER]      = "buffer_write",
+};
+
+static int stats_show(struct seq_file *sf, void *unused)
+{
+  struct spi_flash_prv  *prv = sf->private;
+  struct flash_op_stats *st;
+  unsigned int ii;
+  u64          sum;
+  int          cpu;
+
+  for(ii = 0; ii < FLASH_STAT_MAX; ii++)
+  {
+    sum = 0;
+    for_each_possible_cpu(cpu)
+      sum += per_cpu_ptr(prv->stats, cpu)->count[ii];
+    seq_printf(sf, "%s %llu\n", stat_names[ii], sum);
+  }
+
+  /* Updated under the bus lock, a line may mix two operations */
+  for(ii = 0; ii < FLASH_OP_MAX; ii++)
+  {
+    st = &prv->op_stats[ii];
+    seq_printf(sf, "%s_count %u\n",      lat_names[ii], st->count);
+    seq_printf(sf, "%s_last_us %u\n",    lat_names[ii], st->last_us);
+    seq_printf(sf, "%s_avg_us %u\n",     lat_names[ii], st->avg_us);
+    seq_printf(sf, "%s_max_us %u\n",     lat_names[ii], st->max_us);
+    seq_printf(sf, "%s_total_us %llu\n", lat_names[ii], st->total_us);
+  }
+  return SUCCESS;
+}
+
+static int histogram_show(struct seq_file *sf, void *unused)
+{
+  struct spi_flash_prv *prv = sf->private;
+  unsigned int lat, ii;
+  u64          sum;
+  int          cpu;
+
+  seq_puts(sf, "usec 0");
+  for(ii = 1; ii < FLASH_LAT_BUCKETS; ii++)
+    seq_printf(sf, " %u", 1U << (ii - 1));
+  seq_putc(sf, '\n');
+
+  for(lat = 0; lat < FLASH_LAT_MAX; lat++)
+  {
+    seq_printf(sf, "%s", lat_names[lat]);
+    for(ii = 0; ii < FLASH_LAT_BUCKETS; ii++)
+    {
+      sum = 0;
+      for_each_possible_cpu(cpu)
+        sum += per_cpu_ptr(prv->stats, cpu)->hist[lat][ii];
+      seq_printf(sf, " %llu", sum);
+    }
+    seq_putc(sf, '\n');
+  }
+  return SUCCESS;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, stats_show, inode->i_private);
+}
+
+static int histogram_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, histogram_show, inode->i_private);
+}
+
+/* Counts racing with the reset may survive it, fine for monitoring */
+static ssize_t reset_write(struct file *file, const char __user *buf,
+                           size_t count, loff_t *ppos)
+{
+  struct spi_flash_prv *prv = file->private_data;
+  unsigned int ii;
+  int          cpu;
+
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(prv->stats, cpu), 0, sizeof(struct flash_stats));
+  for(ii = 0; ii < FLASH_OP_MAX; ii++)
+  {
+    prv->op_stats[ii].last_us  = 0;
+    prv->op_stats[ii].max_us   = 0;
+    prv->op_stats[ii].total_us = 0;
+  }
+  return count;
+}
+
+static const struct file_operations stats_fops = {
+  .owner   = THIS_MODULE,
+  .open    = stats_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations histogram_fops = {
+  .owner   = THIS_MODULE,
+  .open    = histogram_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+static const struct file_operations reset_fops = {
+  .owner   = THIS_MODULE,
+  .open    = simple_open,
+  .write   = reset_write,
+  .llseek  = noop_llseek,
 };
 
+/* Statistics are optional, the driver works without debugfs */
+static void spi_flash_debugfs_init(struct spi_flash_prv *prv)
+{
+  prv->debugfs = debugfs_create_dir(prv->name, NULL);
+  if(IS_ERR_OR_NULL(prv->debugfs))
+  {
+    prv->debugfs = NULL;
+    return;
+  }
+  debugfs_create_file("stats", 0444, prv->debugfs, prv, &stats_fops);
+  debugfs_create_file("histogram", 0444, prv->debugfs, prv, &histogram_fops);
+  debugfs_create_file("reset", 0200, prv->debugfs, prv, &reset_fops);
+}
+
 static int spi_flash_probe(struct spi_device *spidev)
 {
   int retval = 0;
+  struct spi_flash_prv *prv;
 
   pr_info("spi_flash.c : %s\r\n",__func__);
 
-  /* Allocate Private Structure */
-  prv = (struct spi_flash_prv *)kzalloc(sizeof(struct spi_flash_prv), GFP_KERNEL);
+  /* Allocate Private Structure, one per chip. Open files and mappings 
+     may hold it past remove, so it goes with the last reference rather
+     than with the device. */
+  prv = kzalloc(sizeof(struct spi_flash_prv), GFP_KERNEL);
   if(prv == NULL)
   {
     pr_info("Requested Memory Allocation Failed\r\n");
     return -ENOMEM;
   }
-  
-  /* Save spi_device reference in private structure */
-  prv->spidev = spidev;
+  kref_init(&prv->ref);
+
+  /* Save spi_device reference in private structure and the other way */
+  prv->spidev = spi_dev_get(spidev);
+  prv->busy_op = FLASH_OP_NONE;
+  spi_set_drvdata(spidev, prv);
+
+  /* Statistics are counted from the first command on */
+  prv->stats = alloc_percpu(struct flash_stats);
+  if(prv->stats == NULL)
+  {
+    retval = -ENOMEM;
+    goto err_free;
+  }
+
+  /* Every chip gets its own numbered device nodes */
+  prv->id = ida_simple_get(&spi_flash_ida, 0, 0, GFP_KERNEL);
+  if(prv->id < 0)
+  {
+    retval = prv->id;
+    goto err_free;
+  }
+  snprintf(prv->name, sizeof(prv->name), "%s%d", DEVICE_NAME, prv->id);
 
   /* Get Device Properties */
-  get_device_properties();
+  get_device_properties(prv);
+  retval = set_clocks(prv);
+  if(retval < 0)
+  {
+    pr_info("SPI Clock Setup Failed\r\n");
+    goto err_ida;
+  }
+
+  /* Page Cache within the configured memory budget */
+  init_rwsem(&prv->lock);
+  mutex_init(&prv->cache_lock);
+  hash_init(prv->cache_hash);
+  INIT_LIST_HEAD(&prv->cache_lru);
+  INIT_DELAYED_WORK(&prv->flush_work, cache_flush_work);
+  INIT_DELAYED_WORK(&prv->rewrite_work, rewrite_work);
+  prv->rewrite_sector = UINT_MAX;
+  INIT_RADIX_TREE(&prv->mmap_pages, GFP_KERNEL);
+
+  /* Asynchronous Submission Queue */
+  spin_lock_init(&prv->aio_lock);
+  INIT_LIST_HEAD(&prv->aio_queue);
+  INIT_WORK(&prv->aio_work, aio_dispatch_work);
+  init_completion(&prv->aio_done);
+  init_waitqueue_head(&prv->aio_wait);
+  atomic_set(&prv->aio_inflight, 0);
+  prv->aio_wq = alloc_workqueue("%s_aio", WQ_UNBOUND | WQ_MEM_RECLAIM, 0, prv->name);
+  if(prv->aio_wq == NULL)
+  {
+    retval = -ENOMEM;
+    goto err_ida;
+  }
+
+  /* DMA-safe command and data buffers, needed before the first command */
+  retval = xfer_pool_alloc(prv);
+  if(retval < 0)
+  {
+    pr_info("Requested Memory Allocation Failed\r\n");
+    goto err_ida;
+  }
+
+  /* The chip may have been left in Deep Power-Down */
+  power_up(prv);
+
+  /* Geometry is needed up front to size the MTD device */
+  if(SUCCESS != get_device_id(prv) || prv->max_pages == 0)
+  {
+    pr_info("No Supported SPI Flash Found\r\n");
+    retval = -ENODEV;
+    goto err_ida;
+  }
+  retval = set_page_size(prv);
+  if(SUCCESS != retval)
+  {
+    pr_info("Page Size Setting Failed\r\n");
+    goto err_ida;
+  }
+
+  prv->rewrite_count = kcalloc(prv->max_pages / prv->sector_pages,
+                               sizeof(*prv->rewrite_count), GFP_KERNEL);
+  if(prv->rewrite_count == NULL)
+  {
+    retval = -ENOMEM;
+    goto err_ida;
+  }
+
+  /* Runtime PM, the chip drops into Deep Power-Down once it has been idle
+     for autosuspend_ms. The delay is tuned per chip at runtime through 
+     power/autosuspend_delay_ms of the SPI device in sysfs. Our reference
+     keeps it awake until probe is done. */
+  pm_runtime_get_noresume(&spidev->dev);
+  pm_runtime_set_autosuspend_delay(&spidev->dev, autosuspend_ms);
+  pm_runtime_use_autosuspend(&spidev->dev);
+  pm_runtime_set_active(&spidev->dev);
+  pm_runtime_enable(&spidev->dev);
+
+  /* The translation layer works on physical pages below the page cache,
+     so the cache is left out when it is in use */
+  prv->ftl  = ftl;
+  prv->size = (loff_t)prv->max_pages * prv->page_size;
+  if(prv->ftl)
+  {
+    retval = ftl_init(prv);
+    if(retval < 0)
+    {
+      pr_info("FTL Setup Failed\r\n");
+      goto err_pm;
+    }
+  }
+  else
+    prv->cache_max = (cache_kb * 1024) / prv->page_size;
 
   /* Using Character Driver Interface but we may also use Sysfs Interface */
 
   /* Register a Miscellaneous Device */
-  retval = misc_register(&device_misc);
+  prv->misc.minor  = MISC_DYNAMIC_MINOR;
+  prv->misc.name   = prv->name;
+  prv->misc.fops   = &device_fops;
+  prv->misc.parent = &spidev->dev;
+  retval = misc_register(&prv->misc);
   if(retval < 0)
   {
-    pr_err("Device Registration Failed with Minor Number %d\r\n",device_misc.minor);
-    return retval;
+    pr_err("Device Registration Failed with Minor Number %d\r\n",prv->misc.minor);
+    goto err_gc;
+  }
+  pr_info("Device Registered : %s with Minor Number : %d\r\n",prv->name, prv->misc.minor);
+
+  /* Register with the MTD Subsystem as well. MTD users address the raw
+     chip, so it is not offered when the translation layer owns it. */
+  if(!prv->ftl)
+  {
+    retval = spi_flash_mtd_register(prv);
+    if(retval < 0)
+    {
+      pr_err("MTD Registration Failed\r\n");
+      goto err_misc;
+    }
+  }
+
+  /* And as a Block Device */
+  retval = spi_flash_blk_register(prv);
+  if(retval < 0)
+  {
+    pr_err("Block Device Registration Failed\r\n");
+    goto err_mtd;
   }
-  pr_info("Device Registered : %s with Minor Number : %d\r\n",DEVICE_NAME, device_misc.minor);
+
+  spi_flash_debugfs_init(prv);
+
+  pm_runtime_mark_last_busy(&spidev->dev);
+  pm_runtime_put_autosuspend(&spidev->dev);
 
   return SUCCESS;
+
+err_mtd:
+  if(!prv->ftl)
+    mtd_device_unregister(&prv->mtd);
+err_misc:
+  misc_deregister(&prv->misc);
+err_gc:
+  if(prv->ftl)
+    cancel_delayed_work_sync(&prv->ftl_gc_work);
+err_pm:
+  cancel_delayed_work_sync(&prv->rewrite_work);
+  pm_runtime_disable(&spidev->dev);
+  pm_runtime_dont_use_autosuspend(&spidev->dev);
+  pm_runtime_put_noidle(&spidev->dev);
+err_ida:
+  ida_simple_remove(&spi_flash_ida, prv->id);
+err_free:
+  /* Buffers, queue and statistics go with it */
+  kref_put(&prv->ref, spi_flash_free);
+  return retval;
 }
 
 static int spi_flash_remove(struct spi_device *spidev)
 {
+  struct spi_flash_prv *prv = spi_get_drvdata(spidev);
+
   pr_info("spi_flash.c : %s\r\n",__func__);
 
-  /* Free up the Private Structure */
-  kfree(prv);
+  /* Keep the chip awake through teardown and leave it so for the next 
+     probe */
+  pm_runtime_get_sync(&spidev->dev);
+
+  debugfs_remove_recursive(prv->debugfs);
+  spi_flash_blk_unregister(prv);
+
+  /* Fails while an MTD user still holds the device, which points at prv
+     through mtd->priv. Wait for the last one to put it before anything 
+     is torn down. */
+  if(!prv->ftl && -EBUSY == mtd_device_unregister(&prv->mtd))
+  {
+    pr_info("Waiting for MTD Users of %s\r\n", prv->name);
+    wait_event(prv->mtd_wait, -EBUSY != mtd_device_unregister(&prv->mtd));
+  }
+
+  pr_info("Device Unregistered : %s with Minor Number : %d\r\n",prv->name, prv->misc.minor);
+
+  /* Unregister the Miscellaneous Device, no new opens after this */
+  misc_deregister(&prv->misc);
+
+  /* Files, mappings and AIO still queued may keep prv past this point. 
+     Once the bus lock is ours nobody is left inside the driver, write
+     back and release the Page Cache and mark the chip gone so everyone
+     after us bails out of flash_lock() with -ENODEV. */
+  down_write(&prv->lock);
+  cache_flush(prv);
+  prv->gone = true;
+  cache_drop(prv, 0, UINT_MAX);
+  mmap_release_pages(prv);
+  up_write(&prv->lock);
 
-  pr_info("Device Unregistered : %s with Minor Number : %d\r\n",DEVICE_NAME, device_misc.minor);
+  /* Nothing can queue them again now. Stale FTL pages are found again 
+     by the scan at the next probe, rewrite counts are lost anyway and an
+     unfinished sweep starts over next time. */
+  cancel_delayed_work_sync(&prv->flush_work);
+  if(prv->ftl)
+    cancel_delayed_work_sync(&prv->ftl_gc_work);
+  cancel_delayed_work_sync(&prv->rewrite_work);
 
-  /* Unregister the Miscellaneous Device */
-  misc_deregister(&device_misc);
+  pm_runtime_disable(&spidev->dev);
+  pm_runtime_dont_use_autosuspend(&spidev->dev);
+  pm_runtime_put_noidle(&spidev->dev);
+
+  ida_simple_remove(&spi_flash_ida, prv->id);
+
+  /* Freed here unless a file or mapping is still around */
+  kref_put(&prv->ref, spi_flash_free);
 
   return SUCCESS;
 }
 
+/* Runtime PM, only called with the chip idle so it is ready and the 
+   command buffer is free */
+static int spi_flash_runtime_suspend(struct device *dev)
+{
+  struct spi_flash_prv *prv = spi_get_drvdata(to_spi_device(dev));
+
+  return power_down(prv);
+}
+
+static int spi_flash_runtime_resume(struct device *dev)
+{
+  struct spi_flash_prv *prv = spi_get_drvdata(to_spi_device(dev));
+
+  return power_up(prv);
+}
+
+static const struct dev_pm_ops spi_flash_pm_ops = {
+  SET_RUNTIME_PM_OPS(spi_flash_runtime_suspend, spi_flash_runtime_resume, NULL)
+};
+
 static struct of_device_id spi_flash_mtable[] = {
   {.compatible = "atmel,at45db161d"},
+  {.compatible = "atmel,at45"},
   {},
 };
  
@@ -500,6 +3881,7 @@ static struct spi_driver spi_flash_drv = {
   .driver = {
     .name           = "SPI_Flash_Driver",
     .of_match_table = spi_flash_mtable,
+    .pm             = &spi_flash_pm_ops,
   },
   .probe  = spi_flash_probe,
   .remove = spi_flash_remove,
@@ -513,6 +3895,6 @@ static struct spi_driver spi_flash_drv = {
 /* Internally calls spi_register_driver() to bind with SPI Core */
 module_spi_driver(spi_flash_drv);
 
-MODULE_DESCRIPTION("High Level Driver for Atmel SPI Data Flash Device AT45DB161D");
+MODULE_DESCRIPTION("High Level Driver for Atmel SPI Data Flash Devices AT45DB011D to AT45DB642D");
 MODULE_AUTHOR("debmalyasarkar1@gmail.com");
 MODULE_LICENSE("GPL");
@@ -1,7 +1,7 @@
 /* SPI Flash Memory is AT45DB161D */
 #define DEVICE_NAME   "at45db161d"
 
-#define MAX_IOCTL 7
+#define MAX_IOCTL 10
 
 #define SUCCESS 0
 
@@ -82,6 +82,12 @@
 #define FLASH_POWER_OF_TWO_PAGE_SIZE4                    0xA6
 #define FLASH_MANUFACTURER_DEVICE_ID_READ                0x9F
 
+/* Status Register Bits */
+#define FLASH_STATUS_READY                               0x80
+#define FLASH_STATUS_COMP                                0x40
+/* Set once the part is configured for 512 byte (binary) pages */
+#define FLASH_STATUS_PAGE_SIZE                           0x01
+
 /* IOCTL Macros for RTC Configuration Operations */
 #define SPI_MAGIC 'D'
 
@@ -92,4 +98,20 @@
 #define ERASE_PAGE      _IOW(SPI_MAGIC,5,uint8_t)
 #define ERASE_SECTOR    _IOW(SPI_MAGIC,6,uint8_t)
 #define ERASE_CHIP      _IOW(SPI_MAGIC,7,uint8_t)
+#define SET_WRITE_MODE  _IOW(SPI_MAGIC,8,uint8_t)
+#define ERASE_RANGE     _IOW(SPI_MAGIC,9,struct flash_erase_range)
+#define GET_PAGE_SIZE   _IOR(SPI_MAGIC,10,uint8_t)
+
+/* Argument for ERASE_RANGE, erases count pages from start_page onwards */
+struct flash_erase_range
+{
+  unsigned int start_page;
+  unsigned int count;
+};
+
+/* Write Modes for SET_WRITE_MODE */
+/* Every page is erased and programmed */
+#define WRITE_MODE_ERASE_PROGRAM 0
+/* Pages matching the new data are compared on chip and left untouched */
+#define WRITE_MODE_COMPARE       1
 
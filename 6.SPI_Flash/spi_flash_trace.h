@@ -0,0 +1,81 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM spi_flash
+
+#if !defined(_SPI_FLASH_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SPI_FLASH_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+   Command tracepoints, enabled through events/spi_flash in tracefs or
+   with perf / trace-cmd -e spi_flash. page is -1 for commands that do
+   not address a page. Completion of an internally timed operation is
+   reported once the device is ready, so its duration covers the busy
+   time, and sr holds the last status register value read. Plain 
+   transfers complete when the SPI message is done, with sr 0. status
+   is 0 or a negative errno in both cases.
+*/
+TRACE_EVENT(spi_flash_cmd_issue,
+
+  TP_PROTO(const char *dev, uint8_t opcode, int page, unsigned int len),
+
+  TP_ARGS(dev, opcode, page, len),
+
+  TP_STRUCT__entry(
+    __string(dev,         dev)
+    __field(uint8_t,      opcode)
+    __field(int,          page)
+    __field(unsigned int, len)
+  ),
+
+  TP_fast_assign(
+    __assign_str(dev, dev);
+    __entry->opcode = opcode;
+    __entry->page   = page;
+    __entry->len    = len;
+  ),
+
+  TP_printk("%s opcode=0x%02x page=%d len=%u", __get_str(dev),
+            __entry->opcode, __entry->page, __entry->len)
+);
+
+TRACE_EVENT(spi_flash_cmd_complete,
+
+  TP_PROTO(const char *dev, uint8_t opcode, int page, unsigned int len,
+           s64 duration_ns, int status, uint8_t sr),
+
+  TP_ARGS(dev, opcode, page, len, duration_ns, status, sr),
+
+  TP_STRUCT__entry(
+    __string(dev,         dev)
+    __field(uint8_t,      opcode)
+    __field(int,          page)
+    __field(unsigned int, len)
+    __field(s64,          duration_ns)
+    __field(int,          status)
+    __field(uint8_t,      sr)
+  ),
+
+  TP_fast_assign(
+    __assign_str(dev, dev);
+    __entry->opcode      = opcode;
+    __entry->page        = page;
+    __entry->len         = len;
+    __entry->duration_ns = duration_ns;
+    __entry->status      = status;
+    __entry->sr          = sr;
+  ),
+
+  TP_printk("%s opcode=0x%02x page=%d len=%u duration=%lldns status=%d sr=0x%02x",
+            __get_str(dev), __entry->opcode, __entry->page, __entry->len,
+            __entry->duration_ns, __entry->status, __entry->sr)
+);
+
+#endif /* _SPI_FLASH_TRACE_H */
+
+/* The header is outside include/trace/events, found through -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE spi_flash_trace
+#include <trace/define_trace.h>